@@ -0,0 +1,109 @@
+#include "boot_sched.h"
+#include <stdlib.h>
+
+typedef struct boot_sched_task_t
+{
+    boot_job_t *job;
+    uint32_t bit;
+    void *arg;
+    EventGroupHandle_t done;
+} boot_sched_task_t;
+
+static void boot_sched_task(void *param)
+{
+    boot_sched_task_t *task = (boot_sched_task_t *)param;
+    task->job->start_us = esp_timer_get_time();
+    task->job->run(task->arg);
+    task->job->end_us = esp_timer_get_time();
+    xEventGroupSetBits(task->done, task->bit);
+    vTaskDelete(NULL);
+}
+
+esp_err_t boot_sched_run(boot_job_t *jobs, size_t count, void *arg)
+{
+    if (count == 0 || count > BOOT_SCHED_MAX_JOBS)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // dependencies only on earlier jobs, so there can be no cycle and the table order is a valid serial order
+    for (size_t i = 0; i < count; i++)
+    {
+        if (jobs[i].deps & ~(BOOT_JOB_BIT(i) - 1))
+        {
+            ESP_LOGE(TAG, "Boot job %s depends on itself or a later job", jobs[i].name);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    boot_sched_task_t *tasks = (boot_sched_task_t *)calloc(count, sizeof(boot_sched_task_t));
+    EventGroupHandle_t done = xEventGroupCreate();
+    if (tasks == NULL || done == NULL)
+    {
+        free(tasks);
+        if (done != NULL)
+        {
+            vEventGroupDelete(done);
+        }
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    uint32_t all = BOOT_JOB_BIT(count) - 1;
+    uint32_t started = 0;
+    uint32_t finished = 0;
+    int64_t start_time = esp_timer_get_time();
+    while (finished != all)
+    {
+        // start every job whose dependencies are done, a task only exists while its job can run
+        for (size_t i = 0; i < count && err == ESP_OK; i++)
+        {
+            uint32_t bit = BOOT_JOB_BIT(i);
+            if ((started & bit) || (jobs[i].deps & ~finished))
+            {
+                continue;
+            }
+            tasks[i].job = &jobs[i];
+            tasks[i].bit = bit;
+            tasks[i].arg = arg;
+            tasks[i].done = done;
+#if CONFIG_FREERTOS_UNICORE
+            // there is only one core to run on, pinning to another one fails an assert
+            BaseType_t core = tskNO_AFFINITY;
+#else
+            BaseType_t core = jobs[i].core;
+#endif
+            if (xTaskCreatePinnedToCore(boot_sched_task, jobs[i].name, jobs[i].stack_size, &tasks[i],
+                                        BOOT_SCHED_TASK_PRIORITY, NULL, core) != pdPASS)
+            {
+                ESP_LOGE(TAG, "Failed to create the task of boot job %s", jobs[i].name);
+                err = ESP_ERR_NO_MEM;
+                break;
+            }
+            started |= bit;
+        }
+        if (err != ESP_OK && started == finished)
+        {
+            break;
+        }
+        // the tasks that are running still use tasks and done, so they are waited for also after an error
+        finished = xEventGroupWaitBits(done, started & ~finished, pdFALSE, pdFALSE, portMAX_DELAY) & all;
+    }
+    int64_t wall_us = esp_timer_get_time() - start_time;
+
+    if (err == ESP_OK)
+    {
+        int64_t serial_us = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            int64_t job_us = jobs[i].end_us - jobs[i].start_us;
+            serial_us += job_us;
+            ESP_LOGI(TAG, "Boot job %-14s %6lld -> %6lld ms (%lld ms)", jobs[i].name, (jobs[i].start_us - start_time) / 1000,
+                     (jobs[i].end_us - start_time) / 1000, job_us / 1000);
+        }
+        ESP_LOGI(TAG, "Boot jobs: %lld ms of work in %lld ms -> %lld ms saved against running them one after another",
+                 serial_us / 1000, wall_us / 1000, (serial_us - wall_us) / 1000);
+    }
+    vEventGroupDelete(done);
+    free(tasks);
+    return err;
+}
@@ -0,0 +1,51 @@
+#ifndef MYLIBBOOTSCHED_H
+#define MYLIBBOOTSCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "common.h"
+
+/*
+Small dependency driven scheduler for the boot: every job runs in its own task, started as soon as the jobs it
+depends on finished, so independent work (Wi-Fi association, key generation, NVS reads, DNS) overlaps on both cores.
+Jobs report errors the way the rest of the boot does (task_fatal_error), a job that returns is done.
+*/
+
+/**** CONFIGURATION ****/
+
+#define BOOT_SCHED_TASK_PRIORITY 5
+// stack of the jobs that only touch NVS, Wi-Fi or DNS
+#define BOOT_JOB_STACK_SIZE 4096
+// stack of the jobs that run mbedtls (key generation, parsing the credentials, TLS requests)
+#define BOOT_JOB_TLS_STACK_SIZE 8192
+
+/****               ****/
+
+// event group bits are one per job, the top byte is reserved by FreeRTOS
+#define BOOT_SCHED_MAX_JOBS 24
+#define BOOT_JOB_BIT(job) (1u << (job))
+
+typedef struct boot_job_t
+{
+    const char *name;
+    void (*run)(void *arg);
+    uint32_t deps;       // BOOT_JOB_BIT of the jobs that have to finish first, only jobs earlier in the table
+    uint32_t stack_size;
+    BaseType_t core;     // core the task is pinned to, or tskNO_AFFINITY (always on CONFIG_FREERTOS_UNICORE builds)
+    // filled in by boot_sched_run, esp_timer_get_time() microseconds
+    int64_t start_us;
+    int64_t end_us;
+} boot_job_t;
+
+// runs the count jobs with arg and returns once all of them finished
+// logs when each one ran and the time saved against running them one after another
+// ESP_ERR_INVALID_ARG if a job depends on itself or a later one, ESP_ERR_NO_MEM if a task could not be created
+esp_err_t boot_sched_run(boot_job_t *jobs, size_t count, void *arg);
+
+#endif
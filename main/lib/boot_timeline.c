@@ -0,0 +1,53 @@
+#include "boot_timeline.h"
+
+static boot_timeline_t boot_timeline;
+
+static const char *boot_phase_names[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_NVS_INIT] = "nvs init",
+    [BOOT_PHASE_WIFI_CREDS] = "wifi creds",
+    [BOOT_PHASE_WIFI_ASSOC] = "wifi assoc",
+    [BOOT_PHASE_GOT_IP] = "got ip",
+    [BOOT_PHASE_AUTH] = "auth",
+    [BOOT_PHASE_ENROLL] = "enroll",
+    [BOOT_PHASE_VERSION_CHECK] = "version check",
+    [BOOT_PHASE_DOWNLOAD] = "download",
+    [BOOT_PHASE_OTA_END] = "ota end",
+};
+
+void boot_phase_start(boot_phase_t phase)
+{
+    // a retry keeps the start of the first attempt, the phase is open again until it ends
+    if (boot_timeline.phases[phase].start_us == 0)
+    {
+        boot_timeline.phases[phase].start_us = esp_timer_get_time();
+    }
+    boot_timeline.phases[phase].end_us = 0;
+}
+
+void boot_phase_end(boot_phase_t phase)
+{
+    boot_timeline.phases[phase].end_us = esp_timer_get_time();
+}
+
+void boot_timeline_store(void)
+{
+    boot_timeline.layout = BOOT_TIMELINE_LAYOUT;
+    boot_timeline.phase_count = BOOT_PHASE_COUNT;
+    boot_timeline.restart_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Boot timeline (ms since reset):");
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++)
+    {
+        const boot_phase_time_t *time = &boot_timeline.phases[i];
+        if (time->start_us == 0)
+        {
+            continue;
+        }
+        ESP_LOGI(TAG, "  %-14s %6lld -> %6lld (%lld ms)", boot_phase_names[i], time->start_us / 1000, time->end_us / 1000,
+                 time->end_us > 0 ? (time->end_us - time->start_us) / 1000 : -1);
+    }
+    ESP_LOGI(TAG, "  restart        %6lld", boot_timeline.restart_us / 1000);
+    if (set_boot_timeline_nvs(&boot_timeline) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store the boot timeline in NVS");
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef MYLIBBOOTTIMELINE_H
+#define MYLIBBOOTTIMELINE_H
+
+#include "esp_timer.h"
+#include "nvs.h"
+
+// stamps of the phases of this run (see boot_timeline_t in nvs.h), kept in RAM until boot_timeline_store
+// a phase that ends more than once (Wi-Fi retries) keeps its first start and its last end
+
+// stamps the start of phase with esp_timer_get_time(), only the first time it starts
+void boot_phase_start(boot_phase_t phase);
+
+// stamps the end of phase with esp_timer_get_time()
+void boot_phase_end(boot_phase_t phase);
+
+// stamps the restart, logs the timeline and stores it in NVS for the application
+void boot_timeline_store(void);
+
+#endif
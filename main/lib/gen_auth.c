@@ -4,22 +4,37 @@
 // the output is a char* with the key in PEM format and will be allocated on the HEAP
 static int generate_rsa_key_pem(char **pem_out);
 
-// Function to generate CSR from an RSA private key in PEM format
+// Function to generate an ECDSA P-256 key and convert to PEM format
+// the output is a char* with the key in PEM format and will be allocated on the HEAP
+static int generate_ec_key_pem(char **pem_out);
+
+// Function to generate CSR from a private key (RSA or EC) in PEM format
 // the output is a char* with the csr in PEM format and will be allocated on the HEAP
-static int generate_csr_from_rsa_key( char *rsa_pem,  char **csr_out);
+static int generate_csr_from_key( char *key_pem,  char **csr_out);
 
 esp_err_t generate_auth_stuff( char **csr_buf,  char **key_buf)
 {
     esp_err_t toReturn;
     int err = 1;
+    int64_t start_time = esp_timer_get_time();
+#ifdef AUTH_KEY_ECDSA
+    const char *key_name = "ECDSA P-256";
+    err = generate_ec_key_pem(key_buf);
+#else
+    const char *key_name = "RSA";
     err = generate_rsa_key_pem(key_buf);
+#endif
+    int64_t key_time = esp_timer_get_time();
 
 
     if (csr_buf && key_buf && err == 0)
     {
-        err = generate_csr_from_rsa_key(*key_buf, csr_buf);
+        err = generate_csr_from_key(*key_buf, csr_buf);
         if (err == 0)
         {
+            // compare both key types with the TLS handshake times in the ota metrics
+            ESP_LOGI(TAG, "%s key generated in %lld ms, CSR in %lld ms", key_name,
+                     (key_time - start_time) / 1000, (esp_timer_get_time() - key_time) / 1000);
             toReturn = ESP_OK;
         }
         else
@@ -120,9 +135,69 @@ cleanup:
 }
 
 
-// Function to generate CSR from an RSA private key in PEM format
+// Function to generate an ECDSA P-256 key and convert to PEM format
+// the output is a char* with the key in PEM format and will be allocated on the HEAP
+static int generate_ec_key_pem(char **pem_out)
+{
+    mbedtls_pk_context pk;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+
+    int ret;
+
+    const char *pers = "ec_genkey";
+
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_pk_init(&pk);
+    mbedtls_entropy_init(&entropy);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)pers, strlen(pers))) != 0)
+    {
+        ESP_LOGE(TAG, "Failed to seed the random generator: -0x%x", -ret);
+        goto cleanup;
+    }
+
+    if ((ret = mbedtls_pk_setup(&pk, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY))) != 0)
+    {
+        ESP_LOGE(TAG, "pk_setup failed: -0x%x", -ret);
+        goto cleanup;
+    }
+
+    ESP_LOGI(TAG, "Generating the ECDSA P-256 key...");
+    if ((ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(pk), mbedtls_ctr_drbg_random, &ctr_drbg)) != 0)
+    {
+        ESP_LOGE(TAG, "mbedtls_ecp_gen_key returned -0x%x", -ret);
+        goto cleanup;
+    }
+
+    unsigned char *privKeyPem = (unsigned char *)calloc(1, KEY_BUF_SIZE);
+    if (privKeyPem == NULL)
+    {
+        ESP_LOGE(TAG, "Memory allocation failed for key PEM buffer.");
+        ret = -1;
+        goto cleanup;
+    }
+    ret = mbedtls_pk_write_key_pem(&pk, privKeyPem, KEY_BUF_SIZE);
+    if (ret != 0)
+    {
+        ESP_LOGE(TAG, "write private key to string failed with code -0x%x", -ret);
+        free(privKeyPem);
+        goto cleanup;
+    }
+    *pem_out = (char *)privKeyPem;
+
+    ESP_LOGI(TAG, "FINISH Successfully generated EC key in PEM format.");
+
+cleanup:
+    mbedtls_pk_free(&pk);
+    mbedtls_ctr_drbg_free(&ctr_drbg);
+    mbedtls_entropy_free(&entropy);
+    return ret;
+}
+
+// Function to generate CSR from a private key (RSA or EC) in PEM format
 // the output is a char* with the csr in PEM format and will be allocated on the HEAP
-static int generate_csr_from_rsa_key( char *rsa_pem,  char **csr_out)
+static int generate_csr_from_key( char *key_pem,  char **csr_out)
 {
     mbedtls_x509write_csr req;
     mbedtls_pk_context key;
@@ -146,11 +221,11 @@ static int generate_csr_from_rsa_key( char *rsa_pem,  char **csr_out)
     }
 
     // Parse the private key
-    if (mbedtls_pk_parse_key(&key, (const unsigned char *)rsa_pem, strlen(rsa_pem) + 1,
-                             NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg) != 0)
+    if ((ret = mbedtls_pk_parse_key(&key, (const unsigned char *)key_pem, strlen(key_pem) + 1,
+                             NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg)) != 0)
     {
         
-        ESP_LOGE(TAG, "Failed to parse RSA key: -0x%x", -ret);
+        ESP_LOGE(TAG, "Failed to parse private key: -0x%x", -ret);
         goto cleanup;
         // Handle error
     }
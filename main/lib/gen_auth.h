@@ -5,23 +5,35 @@
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/ecdsa.h"
+#include "mbedtls/pk.h"
 #include "mbedtls/pem.h"
 #include "mbedtls/x509_csr.h"
 
 #include <stdio.h>
 #include <string.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include "common.h"
 
+/**** CONFIGURATION ****/
+
+// uncomment to generate an ECDSA P-256 device key instead of an RSA one on first boot
+// key generation takes milliseconds instead of seconds and every handshake signs with ECDSA instead of RSA-2048
+// the server that signs the CSR has to accept EC keys. Devices that already have a key in NVS keep it
+// #define AUTH_KEY_ECDSA
+
+/****               ****/
+
 
 // default values - > you shouldnt need to change this ones
 #ifndef CSR_BUF_SIZE
     #define CSR_BUF_SIZE 2048
 #endif
 
+// also the RSA key length in bits
 #ifndef KEY_BUF_SIZE
     #define KEY_BUF_SIZE 2048
 #endif
@@ -31,6 +43,7 @@
 
 // Function to generate the private key and the CSR
 // the output is a char* with the csr in PEM format and will be allocated on the HEAP (no need to allocate it before calling this function)
+// the key is RSA or ECDSA P-256 (AUTH_KEY_ECDSA), both are stored in NVS as PEM the same way
 esp_err_t generate_auth_stuff( char **csr_buf,  char **key_buf);
 
 
@@ -40,7 +53,10 @@ esp_err_t generate_auth_stuff( char **csr_buf,  char **key_buf);
 // Function to generate RSA key and convert it to PEM format
 static int generate_rsa_key_pem(char **pem_out);
 
-// Function to generate CSR from an RSA private key in PEM format
-static int generate_csr_from_rsa_key(char *rsa_pem, char **csr_out);
+// Function to generate an ECDSA P-256 key and convert it to PEM format
+static int generate_ec_key_pem(char **pem_out);
+
+// Function to generate CSR from a private key (RSA or EC) in PEM format
+static int generate_csr_from_key(char *key_pem, char **csr_out);
 */
 #endif 
\ No newline at end of file
@@ -7,12 +7,15 @@
 #include "errno.h"
 #include "esp_tls.h"
 #include "helpers.h"
+#include "nvs.h"
+#include "esp_timer.h"
 #include <string.h>
 #include <sys/param.h>
 #include <ctype.h>
 #include "esp_system.h"
 #include "common.h"
 #include "cJSON.h"
+#include "json_stream.h"
 
 #include "esp_sntp.h"
 #include "esp_netif.h"
@@ -28,24 +31,80 @@
 #include "esp_crt_bundle.h"
 
 #include "mbedtls/debug.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/platform_util.h"
+#include "esp_heap_caps.h"
 
 /**** CONFIGURATION ****/
 #define GET_CRT_URL "https://taylered.io/api/device/register"
 
 #define GET_VERSION_URL "https://mtls.taylered.io/api/device/pull/update"
 
+// comment out to do a full mutual TLS handshake on every connection
+// when enabled each client keeps the session of its first handshake and offers it again when it reconnects,
+// so the server can skip the certificate exchange and the RSA operations (needs CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS)
+#define HTTPS_RESUME_TLS_SESSIONS
+
+// comment out to verify the servers only against the esp certificate bundle
+// when enabled the CA certificate or the SPKI pins in envdata/tlstrust are checked first,
+// the bundle is only searched if they do not match (or envdata/tlstrust is the placeholder)
+#define HTTPS_PINNED_TRUST
+
+// ciphersuites every connection offers, in order of preference (comment out to offer the mbedtls default list)
+// AES-GCM and AES-CBC run on the AES hardware of the esp32s3, ChaCha20-Poly1305 would be software (and is not built in),
+// the servers pick from this list, the ota cipher sweep (OTA_CIPHER_SWEEP) shows what each suite costs
+#define HTTPS_CIPHERSUITES \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256, \
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256, \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384, \
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384, \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256, \
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256, \
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256
+
+// uncomment for modules with little internal RAM
+// every connection asks the server for records of at most HTTPS_MAX_FRAG_LEN (max fragment length extension) and the
+// download runs the serial loop within OTA_HEAP_BUDGET, build with sdkconfig.lowmem so mbedtls frees its buffers between records
+// #define HTTPS_LOW_MEMORY
+
 
 
 
 /****               ****/
 
+#if defined(HTTPS_RESUME_TLS_SESSIONS) && CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+#define HTTPS_SAVE_CLIENT_SESSION 1
+#else
+#define HTTPS_SAVE_CLIENT_SESSION 0
+#endif
+
+#ifdef HTTPS_LOW_MEMORY
+// MBEDTLS_SSL_MAX_FRAG_LEN_4096, servers that do not support the extension still send records up to 16 KB
+#define HTTPS_MAX_FRAG_LEN MBEDTLS_SSL_MAX_FRAG_LEN_4096
+#if !CONFIG_MBEDTLS_DYNAMIC_BUFFER
+#warning "HTTPS_LOW_MEMORY without CONFIG_MBEDTLS_DYNAMIC_BUFFER keeps the full TLS buffers, see sdkconfig.lowmem"
+#endif
+#endif
+
+// esp_http_client default, the download sets its own
+#define HTTPS_TIMEOUT_MS 5000
+
 #define MAX_HTTP_RECV_BUFFER 512
-#define MAX_HTTP_OUTPUT_BUFFER 2048
 
 #ifndef CLIENT_CERT_BUF_SIZE
 #define CLIENT_CERT_BUF_SIZE 2048
 #endif
 
+// the DER of an RSA-2048 private key is about 1200 bytes
+#ifndef CLIENT_KEY_DER_BUF_SIZE
+#define CLIENT_KEY_DER_BUF_SIZE 2048
+#endif
+
 #ifndef URL_BUF_SIZE
 #define URL_BUF_SIZE 100
 #endif
@@ -54,17 +113,146 @@
 #define VERSION_BUF_SIZE 100
 #endif
 
+// base64 of the image signature in the manifest, large enough for RSA-4096
+#ifndef SIGNATURE_BUF_SIZE
+#define SIGNATURE_BUF_SIZE 700
+#endif
+
+// hosts the connection manager keeps a client for
+#ifndef HTTPS_CONN_MAX
+#define HTTPS_CONN_MAX 2
+#endif
+
+#ifndef HTTPS_HOST_BUF_SIZE
+#define HTTPS_HOST_BUF_SIZE 64
+#endif
+
+// sha256 SPKI pins read from envdata/tlstrust
+#ifndef HTTPS_PIN_MAX
+#define HTTPS_PIN_MAX 4
+#endif
+
+extern const uint8_t tlstrust_start[] asm("_binary_tlstrust_start");
+extern const uint8_t tlstrust_end[] asm("_binary_tlstrust_end");
+
+// encodings are short names like "zlib"
+#ifndef OTA_ENCODING_BUF_SIZE
+#define OTA_ENCODING_BUF_SIZE 16
+#endif
+
+// optional fields of the version manifest, empty if the server did not send them (or they did not fit)
+typedef struct ota_manifest_t
+{
+    char delta_url[URL_BUF_SIZE];        // url of a patch that turns the delta_base version into the server version
+    char delta_base[VERSION_BUF_SIZE];   // version the patch was generated against
+    char compression[OTA_ENCODING_BUF_SIZE];       // "zlib" if url serves a compressed image (see ota_inflate.h)
+    char delta_compression[OTA_ENCODING_BUF_SIZE]; // "zlib" if delta_url serves a compressed patch
+    char sha256[2 * 32 + 1];             // hex sha256 of the (uncompressed) image
+    char signature[SIGNATURE_BUF_SIZE];  // base64 signature of the image by the key in envdata/otasignkey
+    uint32_t image_size;     // length of the (uncompressed) image, 0 if the server did not send it
+    uint32_t check_interval; // seconds until the next version check (see rtc_state.h), 0 if the server did not send it
+    manifest_validator_t validator; // ETag and Last-Modified of the response
+    bool not_modified;       // the server answered 304 to the validator sent, nothing else is set
+} ota_manifest_t;
+
+// device certificate and key of the mutual TLS connections, decoded once per boot
+// esp-tls takes them as DER, so no connection base64-decodes the PEM again
+typedef struct https_creds_t
+{
+    unsigned char *cert_der;
+    size_t cert_der_len;
+    unsigned char *key_der;
+    size_t key_der_len;
+    mbedtls_pk_type_t key_type; // MBEDTLS_PK_RSA or MBEDTLS_PK_ECKEY
+} https_creds_t;
+
 // Function to send a CSR to the server and receive a certificate
-// The certificate is stored in cert_buf that will be allocated on the HEAP for you in the function
-// Returns ESP_OK if successful, ESP_FAIL if not
-esp_err_t send_csr(const char *csr, char **cert_buf, char *deviceid_start);
+// The certificate is parsed straight into cert_buf (cert_buf_len bytes, provided by the caller)
+// Returns ESP_OK if successful, ESP_ERR_NO_MEM if the certificate does not fit, ESP_FAIL if not
+esp_err_t send_csr(const char *csr, char *cert_buf, size_t cert_buf_len, char *deviceid_start);
+
+// response of one request, the user_data of _http_event_handler
+// the handler keeps no state of its own, so requests on different clients can run at the same time
+typedef struct https_response_t
+{
+    json_stream_t body;             // the body is parsed as it arrives, into the fields of the caller
+    manifest_validator_t validator; // ETag and Last-Modified of the response
+    int64_t connected_time;         // when the connection was set up, 0 if a kept one was used
+    int64_t header_sent_time;
+    int64_t first_header_time;
+} https_response_t;
 
-// http handler function -> defined as esp32 http example
+// gets response ready for a request whose body values go to fields
+void https_response_init(https_response_t *response, json_field_t *fields, size_t field_count);
+
+// http handler function -> defined as esp32 http example, user_data is the https_response_t of the request
 esp_err_t _http_event_handler(esp_http_client_event_t *evt);
 
 // Function to get the version from the server
-// allocates memory for version_buf and url_buf for you on the HEAP
+// the response is parsed as it arrives, straight into version_buf (VERSION_BUF_SIZE bytes), url_buf (URL_BUF_SIZE bytes)
+// and the manifest, all provided by the caller, fields the server did not send are left empty
+// with a cached validator (can be NULL) the request is conditional (If-None-Match / If-Modified-Since),
+// if the manifest did not change since it returns ESP_OK with manifest->not_modified set and nothing else
+// fills the version_* timings of metrics (can be NULL)
 // returns ESP_OK if successful, ESP_FAIL if not
-esp_err_t get_version_api(char *cert_buf, char *key_buf, char **version_buf, char **url_buf);
+esp_err_t get_version_api(const https_creds_t *creds, const manifest_validator_t *cached, char *version_buf, char *url_buf, ota_manifest_t *manifest, ota_metrics_t *metrics);
+
+// parses the PEM cert and key from NVS once, checks that they belong together and keeps them as DER in creds
+// logs what the parse of the PEM and of the DER cost, which is what every connection paid before and pays now
+// the PEM buffers are not needed afterwards
+esp_err_t https_creds_load(https_creds_t *creds, const char *cert_pem, const char *key_pem);
+
+// frees (and wipes the key of) creds, only after https_conn_close_all
+void https_creds_free(https_creds_t *creds);
+
+// crt_bundle_attach of every client, verifies the server against envdata/tlstrust before the certificate bundle
+// (only the bundle without HTTPS_PINNED_TRUST), it also sets the ciphersuites and the max fragment length of the connection
+esp_err_t https_trust_attach(void *conf);
+
+// makes the connections created from now on offer only ciphersuites (0 terminated, has to stay valid while they connect)
+// NULL goes back to HTTPS_CIPHERSUITES, a kept connection keeps the suite it negotiated until it reconnects
+void https_set_ciphersuites(const int *ciphersuites);
+
+// server chains accepted by envdata/tlstrust and by the bundle since boot, and the time spent verifying them
+void https_trust_stats(uint32_t *pinned, uint32_t *bundle, int64_t *verify_us);
+
+// peak heap use of a request: https_heap_start before it, https_heap_sample while it holds memory
+// (the TLS handshake and the connection events sample on their own) and https_heap_peak after it
+void https_heap_start(void);
+void https_heap_sample(void);
+// bytes the heap went below its free size at https_heap_start
+size_t https_heap_peak(void);
+
+// copies the host of url to host_buf, returns false if it has none or it does not fit
+bool https_url_host(const char *url, char *host_buf, size_t host_buf_len);
+
+// resolves the host of url, the address ends up in the lwip cache for the connection that follows
+// returns the time the lookup took, a failure is only logged and left to esp_http_client_open to report
+int64_t https_resolve_host(const char *url);
+
+/*
+Connection manager: one keep-alive mutual TLS client per host for the whole run, so the download starts on the
+connection (and TLS session) of the version check instead of doing a second handshake.
+The clients only have one event handler, which forwards the events to the handler set by the current user.
+Requests on different hosts can run from different tasks at the same time, a client has one user until it is released.
+*/
+
+// returns the client of the host of url, created with creds on first use
+// NULL if that failed or another request uses the client of that host
+// the url of the client is set to url, a kept connection to the same host stays open
+// the Range and conditional (If-*) headers of the last user are removed
+esp_http_client_handle_t https_conn_get(const char *url, const https_creds_t *creds);
+
+// the events of the next requests of client go to event_handler with user_data as evt->user_data
+void https_conn_set_handler(esp_http_client_handle_t client, http_event_handle_cb event_handler, void *user_data);
+
+// connections (TLS handshakes) the client opened so far, the current one included
+unsigned https_conn_handshakes(esp_http_client_handle_t client);
+
+// the caller is done with client, its connection stays open for the next user
+void https_conn_release(esp_http_client_handle_t client);
+
+// closes the connections and frees all clients
+void https_conn_close_all(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,385 @@
+#include "json_stream.h"
+#include <string.h>
+#include "esp_log.h"
+
+static bool json_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int json_hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+void json_stream_init(json_stream_t *stream, json_field_t *fields, size_t field_count)
+{
+    memset(stream, 0, sizeof(json_stream_t));
+    stream->fields = fields;
+    stream->field_count = field_count;
+    for (size_t i = 0; i < field_count; i++)
+    {
+        fields[i].found = false;
+        fields[i].too_long = false;
+        if (fields[i].buf != NULL && fields[i].buf_size > 0)
+        {
+            fields[i].buf[0] = '\0';
+        }
+    }
+}
+
+json_field_t *json_stream_field(json_stream_t *stream, const char *key)
+{
+    for (size_t i = 0; i < stream->field_count; i++)
+    {
+        if (strcmp(stream->fields[i].key, key) == 0)
+        {
+            return &stream->fields[i];
+        }
+    }
+    return NULL;
+}
+
+// appends a decoded byte of a string to the key or to the string field of the value
+static void json_string_append(json_stream_t *stream, bool in_key, char c)
+{
+    if (in_key)
+    {
+        if (stream->key_len + 1 < sizeof(stream->key))
+        {
+            stream->key[stream->key_len++] = c;
+        }
+        else
+        {
+            stream->key_too_long = true;
+        }
+        return;
+    }
+    json_field_t *field = stream->field;
+    if (field == NULL || field->too_long)
+    {
+        return;
+    }
+    if (stream->value_len + 1 < field->buf_size)
+    {
+        field->buf[stream->value_len++] = c;
+    }
+    else
+    {
+        field->too_long = true;
+        field->buf[0] = '\0';
+    }
+}
+
+// \u escapes are written as UTF-8, surrogate pairs are not combined
+static void json_string_append_unicode(json_stream_t *stream, bool in_key, uint16_t code)
+{
+    if (code < 0x80)
+    {
+        json_string_append(stream, in_key, (char)code);
+    }
+    else if (code < 0x800)
+    {
+        json_string_append(stream, in_key, (char)(0xc0 | (code >> 6)));
+        json_string_append(stream, in_key, (char)(0x80 | (code & 0x3f)));
+    }
+    else
+    {
+        json_string_append(stream, in_key, (char)(0xe0 | (code >> 12)));
+        json_string_append(stream, in_key, (char)(0x80 | ((code >> 6) & 0x3f)));
+        json_string_append(stream, in_key, (char)(0x80 | (code & 0x3f)));
+    }
+}
+
+// takes one byte of a key or string value, returns false at its closing quote
+static bool json_string_byte(json_stream_t *stream, bool in_key, char c)
+{
+    if (stream->unicode_left > 0)
+    {
+        int value = json_hex_value(c);
+        if (value < 0)
+        {
+            stream->state = JSON_STREAM_ERROR;
+            return true;
+        }
+        stream->unicode = (uint16_t)((stream->unicode << 4) | value);
+        if (--stream->unicode_left == 0)
+        {
+            json_string_append_unicode(stream, in_key, stream->unicode);
+        }
+        return true;
+    }
+    if (stream->escape)
+    {
+        stream->escape = false;
+        switch (c)
+        {
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u':
+            stream->unicode_left = 4;
+            stream->unicode = 0;
+            return true;
+        case '"':
+        case '\\':
+        case '/':
+            break;
+        default:
+            stream->state = JSON_STREAM_ERROR;
+            return true;
+        }
+        json_string_append(stream, in_key, c);
+        return true;
+    }
+    if (c == '\\')
+    {
+        stream->escape = true;
+        return true;
+    }
+    if (c == '"')
+    {
+        return false;
+    }
+    json_string_append(stream, in_key, c);
+    return true;
+}
+
+// the key is complete, looks up the field its value goes to
+static void json_key_done(json_stream_t *stream)
+{
+    stream->key[stream->key_len] = '\0';
+    stream->field = stream->key_too_long ? NULL : json_stream_field(stream, stream->key);
+    stream->value_len = 0;
+}
+
+// the literal is complete, numbers go to a number field
+static void json_literal_done(json_stream_t *stream)
+{
+    json_field_t *field = stream->field;
+    stream->field = NULL;
+    stream->literal[stream->literal_len] = '\0';
+    if (field == NULL || field->number == NULL)
+    {
+        return;
+    }
+    // only the integer part of a non negative number is kept, a fraction is dropped
+    uint32_t value = 0;
+    size_t i = 0;
+    for (; stream->literal[i] >= '0' && stream->literal[i] <= '9'; i++)
+    {
+        uint32_t digit = (uint32_t)(stream->literal[i] - '0');
+        if (value > (UINT32_MAX - digit) / 10)
+        {
+            field->too_long = true;
+            return;
+        }
+        value = value * 10 + digit;
+    }
+    if (i == 0 || stream->literal_too_long || (stream->literal[i] != '\0' && stream->literal[i] != '.'))
+    {
+        // negative, exponent, true/false/null or too long for the buffer
+        field->too_long = stream->literal_too_long;
+        return;
+    }
+    *field->number = value;
+    field->found = true;
+}
+
+esp_err_t json_stream_feed(json_stream_t *stream, const char *data, size_t len)
+{
+    size_t head_copy = stream->total < sizeof(stream->head) - 1 ? sizeof(stream->head) - 1 - stream->total : 0;
+    if (head_copy > len)
+    {
+        head_copy = len;
+    }
+    memcpy(stream->head + stream->total, data, head_copy);
+    stream->total += len;
+
+    for (size_t i = 0; i < len && stream->state != JSON_STREAM_ERROR; i++)
+    {
+        char c = data[i];
+        switch (stream->state)
+        {
+        case JSON_STREAM_START:
+            if (c == '{')
+            {
+                stream->state = JSON_STREAM_KEY_START;
+            }
+            else if (!json_is_space(c))
+            {
+                stream->state = JSON_STREAM_ERROR;
+            }
+            break;
+        case JSON_STREAM_KEY_START:
+            if (c == '"')
+            {
+                stream->key_len = 0;
+                stream->key_too_long = false;
+                stream->state = JSON_STREAM_KEY;
+            }
+            else if (c == '}')
+            {
+                stream->state = JSON_STREAM_DONE;
+            }
+            else if (!json_is_space(c))
+            {
+                stream->state = JSON_STREAM_ERROR;
+            }
+            break;
+        case JSON_STREAM_KEY:
+            if (!json_string_byte(stream, true, c))
+            {
+                json_key_done(stream);
+                stream->state = JSON_STREAM_COLON;
+            }
+            break;
+        case JSON_STREAM_COLON:
+            if (c == ':')
+            {
+                stream->state = JSON_STREAM_VALUE;
+            }
+            else if (!json_is_space(c))
+            {
+                stream->state = JSON_STREAM_ERROR;
+            }
+            break;
+        case JSON_STREAM_VALUE:
+            if (json_is_space(c))
+            {
+                break;
+            }
+            if (c == '"')
+            {
+                // a string only goes to a string field
+                if (stream->field != NULL && stream->field->buf == NULL)
+                {
+                    stream->field = NULL;
+                }
+                stream->state = JSON_STREAM_STRING;
+            }
+            else if (c == '{' || c == '[')
+            {
+                stream->field = NULL;
+                stream->depth = 1;
+                stream->nested_string = false;
+                stream->state = JSON_STREAM_NESTED;
+            }
+            else if (c == ',' || c == '}' || c == ']' || c == ':')
+            {
+                stream->state = JSON_STREAM_ERROR;
+            }
+            else
+            {
+                stream->literal[0] = c;
+                stream->literal_len = 1;
+                stream->literal_too_long = false;
+                stream->state = JSON_STREAM_LITERAL;
+            }
+            break;
+        case JSON_STREAM_STRING:
+            if (!json_string_byte(stream, false, c))
+            {
+                // an empty string counts as found too
+                if (stream->field != NULL && !stream->field->too_long)
+                {
+                    stream->field->buf[stream->value_len] = '\0';
+                    stream->field->found = true;
+                }
+                stream->field = NULL;
+                stream->state = JSON_STREAM_NEXT;
+            }
+            break;
+        case JSON_STREAM_LITERAL:
+            if (json_is_space(c) || c == ',' || c == '}')
+            {
+                json_literal_done(stream);
+                stream->state = c == ',' ? JSON_STREAM_KEY_START : c == '}' ? JSON_STREAM_DONE : JSON_STREAM_NEXT;
+            }
+            else if (stream->literal_len + 1 < sizeof(stream->literal))
+            {
+                stream->literal[stream->literal_len++] = c;
+            }
+            else
+            {
+                stream->literal_too_long = true;
+            }
+            break;
+        case JSON_STREAM_NESTED:
+            if (stream->nested_string)
+            {
+                if (stream->escape)
+                {
+                    stream->escape = false;
+                }
+                else if (c == '\\')
+                {
+                    stream->escape = true;
+                }
+                else if (c == '"')
+                {
+                    stream->nested_string = false;
+                }
+            }
+            else if (c == '"')
+            {
+                stream->nested_string = true;
+            }
+            else if (c == '{' || c == '[')
+            {
+                stream->depth++;
+            }
+            else if ((c == '}' || c == ']') && --stream->depth == 0)
+            {
+                stream->state = JSON_STREAM_NEXT;
+            }
+            break;
+        case JSON_STREAM_NEXT:
+            if (c == ',')
+            {
+                stream->state = JSON_STREAM_KEY_START;
+            }
+            else if (c == '}')
+            {
+                stream->state = JSON_STREAM_DONE;
+            }
+            else if (!json_is_space(c))
+            {
+                stream->state = JSON_STREAM_ERROR;
+            }
+            break;
+        case JSON_STREAM_DONE:
+            if (!json_is_space(c))
+            {
+                stream->state = JSON_STREAM_ERROR;
+            }
+            break;
+        case JSON_STREAM_ERROR:
+            break;
+        }
+    }
+    if (stream->state == JSON_STREAM_ERROR)
+    {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t json_stream_finish(const json_stream_t *stream)
+{
+    return stream->state == JSON_STREAM_DONE ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+}
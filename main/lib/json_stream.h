@@ -0,0 +1,94 @@
+#ifndef MYLIBJSONSTREAM_H
+#define MYLIBJSONSTREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "common.h"
+
+/*
+Streaming parser for the small flat JSON objects the servers answer with (the version manifest and the enrollment response).
+Bytes are fed as they arrive from the network in any split, the values of the keys in a table of fields are written
+straight into the storage of the caller. Nothing is allocated and the response can have any length: unknown keys,
+nested objects and arrays are skipped without being stored.
+*/
+
+/**** CONFIGURATION ****/
+
+// keys longer than this can not match a field and are skipped
+#ifndef JSON_STREAM_KEY_SIZE
+#define JSON_STREAM_KEY_SIZE 24
+#endif
+
+// first bytes of the response kept for the log when it is not what was expected
+#ifndef JSON_STREAM_HEAD_SIZE
+#define JSON_STREAM_HEAD_SIZE 96
+#endif
+
+/****               ****/
+
+// one key of the object and where its value goes, either a string (buf) or an unsigned integer (number)
+typedef struct json_field_t
+{
+    const char *key;
+    char *buf;        // null terminated string value, at most buf_size - 1 bytes
+    size_t buf_size;
+    uint32_t *number; // integer part of a number value
+    bool found;       // the value was complete and fit
+    bool too_long;    // the value did not fit into buf (or uint32_t), buf is left empty
+} json_field_t;
+
+typedef enum
+{
+    JSON_STREAM_START,
+    JSON_STREAM_KEY_START, // after '{' or ','
+    JSON_STREAM_KEY,
+    JSON_STREAM_COLON,
+    JSON_STREAM_VALUE,
+    JSON_STREAM_STRING,
+    JSON_STREAM_LITERAL,   // number, true, false or null
+    JSON_STREAM_NESTED,    // inside an object or array value
+    JSON_STREAM_NEXT,      // after a value
+    JSON_STREAM_DONE,
+    JSON_STREAM_ERROR,
+} json_stream_state_t;
+
+typedef struct json_stream_t
+{
+    json_field_t *fields;
+    size_t field_count;
+
+    json_stream_state_t state;
+    char key[JSON_STREAM_KEY_SIZE];
+    size_t key_len;
+    bool key_too_long;
+    json_field_t *field;  // field of the current value, NULL if it is skipped
+    size_t value_len;
+    bool escape;          // the last string byte was a backslash
+    uint8_t unicode_left; // hex digits of a \u escape still to come
+    uint16_t unicode;
+    char literal[16];     // number, true, false or null value
+    size_t literal_len;
+    bool literal_too_long;
+    uint32_t depth;       // of the nested value being skipped
+    bool nested_string;   // inside a string of the nested value
+
+    char head[JSON_STREAM_HEAD_SIZE]; // null terminated start of the response
+    size_t total;         // bytes fed so far
+} json_stream_t;
+
+// gets ready for a new response, clears found/too_long and the buffers of the fields
+void json_stream_init(json_stream_t *stream, json_field_t *fields, size_t field_count);
+
+// parses the next bytes of the response
+// returns ESP_ERR_INVALID_RESPONSE once the response is not a JSON object, the bytes after that are ignored
+esp_err_t json_stream_feed(json_stream_t *stream, const char *data, size_t len);
+
+// returns ESP_OK if the response was one complete JSON object
+esp_err_t json_stream_finish(const json_stream_t *stream);
+
+// returns the field of key in the table
+json_field_t *json_stream_field(json_stream_t *stream, const char *key);
+
+#endif
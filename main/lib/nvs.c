@@ -346,4 +346,425 @@ esp_err_t set_version_in_nvs(const char *version)
 cleanup:
     nvs_close(nvs_handle);
     return err;
-}
\ No newline at end of file
+}
+
+int get_ota_progress_nvs(ota_progress_t *progress)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    size_t required_size = sizeof(ota_progress_t);
+    err = nvs_get_blob(nvs_handle, "ota_progress", progress, &required_size);
+    if (err == ESP_OK && required_size == sizeof(ota_progress_t))
+    {
+        // make sure the strings are terminated even if the blob was written by someone else
+        progress->url[URL_BUF_SIZE - 1] = '\0';
+        progress->version[VERSION_BUF_SIZE - 1] = '\0';
+        progress->etag[OTA_ETAG_SIZE - 1] = '\0';
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGI(TAG, "No ota download checkpoint in NVS");
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read ota download checkpoint (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_ota_progress_nvs(const ota_progress_t *progress)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs_handle, "ota_progress", progress, sizeof(ota_progress_t));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+esp_err_t clear_ota_progress_nvs(void)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_erase_key(nvs_handle, "ota_progress");
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        err = ESP_OK;
+    }
+    else if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+int get_ota_chunk_size_nvs(uint32_t *chunk_size)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    err = nvs_get_u32(nvs_handle, "ota_chunk", chunk_size);
+    if (err == ESP_OK)
+    {
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read ota chunk size (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_ota_chunk_size_nvs(uint32_t chunk_size)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_u32(nvs_handle, "ota_chunk", chunk_size);
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+int get_ota_metrics_nvs(ota_metrics_t *metrics)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    size_t required_size = sizeof(ota_metrics_t);
+    err = nvs_get_blob(nvs_handle, "ota_metrics", metrics, &required_size);
+    if (err == ESP_OK && required_size == sizeof(ota_metrics_t) && metrics->layout == OTA_METRICS_LAYOUT)
+    {
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH)
+    {
+        // written by an older build, same as none
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read ota metrics (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_ota_metrics_nvs(const ota_metrics_t *metrics)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs_handle, "ota_metrics", metrics, sizeof(ota_metrics_t));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+int get_manifest_validator_nvs(manifest_validator_t *validator)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    size_t required_size = sizeof(manifest_validator_t);
+    err = nvs_get_blob(nvs_handle, "manifest_val", validator, &required_size);
+    if (err == ESP_OK && required_size == sizeof(manifest_validator_t))
+    {
+        // make sure the strings are terminated even if the blob was written by someone else
+        validator->etag[OTA_ETAG_SIZE - 1] = '\0';
+        validator->last_modified[MANIFEST_LAST_MODIFIED_SIZE - 1] = '\0';
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read manifest validator (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_manifest_validator_nvs(const manifest_validator_t *validator)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs_handle, "manifest_val", validator, sizeof(manifest_validator_t));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+int get_wifi_ap_nvs(wifi_ap_cache_t *ap)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("device_creds", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    size_t required_size = sizeof(wifi_ap_cache_t);
+    err = nvs_get_blob(nvs_handle, "wifi_ap", ap, &required_size);
+    if (err == ESP_OK && required_size == sizeof(wifi_ap_cache_t))
+    {
+        // make sure the string is terminated even if the blob was written by someone else
+        ap->ssid[sizeof(ap->ssid) - 1] = '\0';
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH)
+    {
+        // written by an older build, same as none
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read cached AP (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_wifi_ap_nvs(const wifi_ap_cache_t *ap)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("device_creds", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs_handle, "wifi_ap", ap, sizeof(wifi_ap_cache_t));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+int get_wifi_lease_nvs(wifi_lease_t *lease)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("device_creds", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    size_t required_size = sizeof(wifi_lease_t);
+    err = nvs_get_blob(nvs_handle, "wifi_lease", lease, &required_size);
+    if (err == ESP_OK && required_size == sizeof(wifi_lease_t))
+    {
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH)
+    {
+        // written by an older build, same as none
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read DHCP lease (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_wifi_lease_nvs(const wifi_lease_t *lease)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("device_creds", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs_handle, "wifi_lease", lease, sizeof(wifi_lease_t));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+int get_wifi_assoc_hist_nvs(wifi_assoc_hist_t *hist)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    size_t required_size = sizeof(wifi_assoc_hist_t);
+    err = nvs_get_blob(nvs_handle, "wifi_hist", hist, &required_size);
+    if (err == ESP_OK && required_size == sizeof(wifi_assoc_hist_t))
+    {
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH)
+    {
+        // written by an older build, same as none
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read association histogram (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_wifi_assoc_hist_nvs(const wifi_assoc_hist_t *hist)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs_handle, "wifi_hist", hist, sizeof(wifi_assoc_hist_t));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
+
+int get_boot_timeline_nvs(boot_timeline_t *timeline)
+{
+    int toReturn = 1; // 0 if success, -1 if not found, 1 if error
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for read: %s", esp_err_to_name(err));
+        return toReturn;
+    }
+
+    size_t required_size = sizeof(boot_timeline_t);
+    err = nvs_get_blob(nvs_handle, "boot_timeline", timeline, &required_size);
+    if (err == ESP_OK && required_size == sizeof(boot_timeline_t) && timeline->layout == BOOT_TIMELINE_LAYOUT)
+    {
+        toReturn = 0;
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_OK || err == ESP_ERR_NVS_INVALID_LENGTH)
+    {
+        // written by an older build, same as none
+        toReturn = -1;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to read boot timeline (%s)", esp_err_to_name(err));
+    }
+    nvs_close(nvs_handle);
+    return toReturn;
+}
+
+esp_err_t set_boot_timeline_nvs(const boot_timeline_t *timeline)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("mtls_auth", NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error opening NVS for write: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(nvs_handle, "boot_timeline", timeline, sizeof(boot_timeline_t));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+    return err;
+}
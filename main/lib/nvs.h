@@ -13,6 +13,163 @@
 
 #include "common.h"
 
+#ifndef URL_BUF_SIZE
+#define URL_BUF_SIZE 100
+#endif
+
+#ifndef VERSION_BUF_SIZE
+#define VERSION_BUF_SIZE 100
+#endif
+
+#ifndef OTA_ETAG_SIZE
+#define OTA_ETAG_SIZE 64
+#endif
+
+// checkpoint of an interrupted ota download, stored as a blob in the mtls_auth namespace
+typedef struct ota_progress_t
+{
+    char url[URL_BUF_SIZE];
+    char version[VERSION_BUF_SIZE];
+    char etag[OTA_ETAG_SIZE]; // empty if the server did not send one
+    uint32_t total_length;    // length of the whole image reported by the server
+    uint32_t bytes_written;   // bytes of the image already in the update partition (sector aligned)
+    uint8_t sha256[32];       // sha256 of the first bytes_written bytes of the image
+} ota_progress_t;
+
+#ifndef MANIFEST_LAST_MODIFIED_SIZE
+#define MANIFEST_LAST_MODIFIED_SIZE 32
+#endif
+
+// validators of the last version manifest the device is up to date with, stored as a blob in the mtls_auth namespace
+// the next version check sends them, so the server can answer 304 instead of sending the manifest again
+typedef struct manifest_validator_t
+{
+    char etag[OTA_ETAG_SIZE];                         // ETag of the manifest, empty if the server did not send one
+    char last_modified[MANIFEST_LAST_MODIFIED_SIZE];  // Last-Modified of the manifest, empty if the server did not send one
+} manifest_validator_t;
+
+// bump when the layout of ota_metrics_t changes, so old blobs are not misread
+#define OTA_METRICS_LAYOUT 8
+
+// metrics of the last update run, stored as a blob in the mtls_auth namespace
+// times are in microseconds and 0 if the phase did not run, the download ones are summed over all attempts
+typedef struct ota_metrics_t
+{
+    uint32_t layout;            // OTA_METRICS_LAYOUT
+    int32_t result;             // esp_err_t of the run
+    // Wi-Fi
+    int64_t wifi_assoc_us;      // Wi-Fi start until associated
+    uint32_t wifi_ap_cache;     // 0 full scan (no cached AP), 1 cached AP, 2 the cached AP failed and a full scan followed
+    int64_t wifi_ip_us;         // associated until the IP
+    uint32_t wifi_ip_method;    // 0 DHCP, 1 DHCP kept the cached address (INIT-REBOOT), 2 cached lease applied as static config
+    // version check (get_version_api)
+    int64_t version_connect_us; // DNS, TCP and TLS handshake
+    int64_t version_ttfb_us;    // request sent until the first response header
+    int64_t version_total_us;
+    int32_t version_status;     // HTTP status of the version check, 304 if the manifest did not change
+    uint32_t version_heap_peak; // bytes of heap the version check used at most, TLS connection included
+    // download (ota_update)
+    int64_t dns_us;             // resolving the host of the image url
+    int64_t connect_us;         // TCP and TLS handshake and sending the request (only the request on a kept alive connection)
+    int64_t ttfb_us;            // request sent until the response headers are in
+    int64_t read_us;            // spent in esp_http_client_read
+    int64_t flash_us;           // comparing, erasing and programming sectors
+    int64_t verify_us;          // digest and signature check, image read back
+    int64_t download_total_us;  // whole ota_update
+    int64_t boot_set_us;        // ota_end
+    uint32_t download_heap_peak; // bytes of heap ota_update used at most (buffers, tasks, decompressor, TLS connection)
+    // TLS handshakes of the whole run (version check and download), TCP connect included
+    int64_t tls_handshake_us;
+    uint32_t tls_handshakes;
+    uint32_t tls_sessions_offered; // handshakes that offered the session of an earlier one for resumption
+    int64_t tls_verify_us;      // spent anchoring the server chains (pinned trust and bundle search), part of the handshakes
+    uint32_t tls_pinned;        // server chains accepted by envdata/tlstrust
+    uint32_t tls_bundle;        // server chains accepted by the certificate bundle
+    uint32_t key_type;          // mbedtls_pk_type_t of the device key (1 RSA, 2 ECDSA), the handshake times depend on it
+    uint32_t bytes_received;    // bytes on the wire
+    uint32_t bytes_written;     // image bytes
+    uint32_t requests;          // HTTP requests of the download (probe, patch, resumes)
+    uint32_t attempts;          // download attempts that broke off
+    uint32_t read_calls;
+    uint32_t read_min_us;       // latency of a single esp_http_client_read
+    uint32_t read_avg_us;
+    uint32_t read_max_us;
+    uint32_t stalls;            // reads that took longer than OTA_STALL_THRESHOLD_US
+    uint32_t sectors_written;
+    uint32_t sectors_skipped;
+} ota_metrics_t;
+
+// bump when the layout of boot_timeline_t changes
+#define BOOT_TIMELINE_LAYOUT 1
+
+// phases of one run of the updater, the index of a phase in boot_timeline_t never changes (new ones are appended)
+typedef enum
+{
+    BOOT_PHASE_NVS_INIT = 0,  // init_nvs
+    BOOT_PHASE_WIFI_CREDS,    // Wi-Fi credentials and device id from NVS
+    BOOT_PHASE_WIFI_ASSOC,    // Wi-Fi start until associated with the AP
+    BOOT_PHASE_GOT_IP,        // associated until the DHCP lease
+    BOOT_PHASE_AUTH,          // cert and key from NVS and decoded, key generation and enrollment on the first boot included
+    BOOT_PHASE_ENROLL,        // send_csr request (first boot only)
+    BOOT_PHASE_VERSION_CHECK, // get_version_api request
+    BOOT_PHASE_DOWNLOAD,      // ota_update, the image download and the OTA write
+    BOOT_PHASE_OTA_END,       // ota_end
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+// start and end of a phase in esp_timer_get_time() microseconds since reset, both 0 if the phase did not run
+typedef struct boot_phase_time_t
+{
+    int64_t start_us;
+    int64_t end_us;
+} boot_phase_time_t;
+
+// timeline of the last full run of the updater, stored as the boot_timeline blob in the mtls_auth namespace
+// the application can read it without linking any updater code, little endian, 16 + 16 * phase_count bytes:
+// offset 0 layout (u32), 4 phase_count (u32), 8 restart_us (i64), 16 + 16 * phase start_us (i64), 24 + 16 * phase end_us (i64)
+typedef struct boot_timeline_t
+{
+    uint32_t layout;      // BOOT_TIMELINE_LAYOUT
+    uint32_t phase_count; // BOOT_PHASE_COUNT
+    int64_t restart_us;   // just before esp_restart
+    boot_phase_time_t phases[BOOT_PHASE_COUNT];
+} boot_timeline_t;
+
+// the AP of the last association, stored as the wifi_ap blob in the device_creds namespace
+// the next connect goes straight to it (see WIFI_FAST_RECONNECT in wifi.h)
+typedef struct wifi_ap_cache_t
+{
+    char ssid[33];     // null terminated, the cache only applies while the configured SSID is the same
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t authmode;  // wifi_auth_mode_t the AP negotiated
+} wifi_ap_cache_t;
+
+// the last DHCP lease, stored as the wifi_lease blob in the device_creds namespace (see WIFI_STATIC_LEASE in wifi.h)
+// addresses in network byte order like esp_ip4_addr_t
+typedef struct wifi_lease_t
+{
+    uint8_t bssid[6];      // AP the lease was obtained through
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gw;
+    uint32_t dns;
+    int64_t obtained_us;   // system time (gettimeofday) of the DHCP ACK
+    uint32_t lease_s;      // lease time the server granted
+    int64_t full_dhcp_us;  // associated until the IP, measured on the last connect without a cached lease
+} wifi_lease_t;
+
+// buckets of wifi_assoc_hist_t: < 250, < 500, < 1000, < 2000, < 4000 and >= 4000 ms
+#define WIFI_ASSOC_BUCKETS 6
+
+// association times (Wi-Fi start until associated) of all connects so far, with and without the cached AP
+// stored as the wifi_hist blob in the mtls_auth namespace
+typedef struct wifi_assoc_hist_t
+{
+    uint32_t cached[WIFI_ASSOC_BUCKETS];  // went straight to the cached AP
+    uint32_t scanned[WIFI_ASSOC_BUCKETS]; // full scan, no cached AP or it failed
+} wifi_assoc_hist_t;
+
 extern const uint8_t wifissid_start[] asm("_binary_wifissid_start");
 extern const uint8_t wifissid_end[] asm("_binary_wifissid_end");
 
@@ -54,5 +211,70 @@ esp_err_t set_version_in_nvs(const char *version);
 
 esp_err_t set_device_creds_nvs();
 
+// Get the checkpoint of an interrupted ota download from the NVS
+// Returns 0 if success, -1 if not found, 1 if error
+int get_ota_progress_nvs(ota_progress_t *progress);
+
+// Set the checkpoint of the ota download in the NVS
+// does not take ownership of the struct(copies the data)
+esp_err_t set_ota_progress_nvs(const ota_progress_t *progress);
+
+// Removes the ota download checkpoint from the NVS (not finding it is not an error)
+esp_err_t clear_ota_progress_nvs(void);
+
+// Get the ota chunk size (bytes per network read) from the NVS
+// Returns 0 if success, -1 if not found, 1 if error
+int get_ota_chunk_size_nvs(uint32_t *chunk_size);
+
+// Set the ota chunk size in the NVS
+esp_err_t set_ota_chunk_size_nvs(uint32_t chunk_size);
+
+// Get the validators of the last manifest the device is up to date with from the NVS
+// Returns 0 if success, -1 if not found, 1 if error
+int get_manifest_validator_nvs(manifest_validator_t *validator);
+
+// Set the validators of the manifest in the NVS
+// does not take ownership of the struct(copies the data)
+esp_err_t set_manifest_validator_nvs(const manifest_validator_t *validator);
+
+// Get the metrics of the last update run from the NVS
+// Returns 0 if success, -1 if not found (or stored with another layout), 1 if error
+int get_ota_metrics_nvs(ota_metrics_t *metrics);
+
+// Set the metrics of the last update run in the NVS
+// does not take ownership of the struct(copies the data)
+esp_err_t set_ota_metrics_nvs(const ota_metrics_t *metrics);
+
+// Get the AP of the last association from the NVS
+// Returns 0 if success, -1 if not found, 1 if error
+int get_wifi_ap_nvs(wifi_ap_cache_t *ap);
+
+// Set the AP of the last association in the NVS
+// does not take ownership of the struct(copies the data)
+esp_err_t set_wifi_ap_nvs(const wifi_ap_cache_t *ap);
+
+// Get the last DHCP lease from the NVS
+// Returns 0 if success, -1 if not found, 1 if error
+int get_wifi_lease_nvs(wifi_lease_t *lease);
+
+// Set the DHCP lease in the NVS
+// does not take ownership of the struct(copies the data)
+esp_err_t set_wifi_lease_nvs(const wifi_lease_t *lease);
+
+// Get the association time histogram from the NVS
+// Returns 0 if success, -1 if not found, 1 if error
+int get_wifi_assoc_hist_nvs(wifi_assoc_hist_t *hist);
+
+// Set the association time histogram in the NVS
+// does not take ownership of the struct(copies the data)
+esp_err_t set_wifi_assoc_hist_nvs(const wifi_assoc_hist_t *hist);
+
+// Get the timeline of the last full updater run from the NVS
+// Returns 0 if success, -1 if not found (or stored with another layout), 1 if error
+int get_boot_timeline_nvs(boot_timeline_t *timeline);
+
+// Set the timeline of the updater run in the NVS
+// does not take ownership of the struct(copies the data)
+esp_err_t set_boot_timeline_nvs(const boot_timeline_t *timeline);
 
 #endif
\ No newline at end of file
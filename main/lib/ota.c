@@ -1,166 +1,1927 @@
 #include "ota.h"
 
+#define OTA_ERASE_PROGRESS_BIT BIT0
+#define OTA_ERASE_DONE_BIT BIT1
 
+// background erase of the update partition ahead of the writer
+typedef struct ota_erase_ahead_t
+{
+    const esp_partition_t *partition;
+    size_t start;               // sector aligned, the writer has not touched anything from here on
+    size_t end;                 // sector aligned end of the expected image
+    volatile size_t erased_end; // [start, erased_end) is erased
+    volatile bool cancel;
+    EventGroupHandle_t events;  // OTA_ERASE_PROGRESS_BIT after every erase, OTA_ERASE_DONE_BIT when the task ends
+} ota_erase_ahead_t;
+
+// state of one ota download, shared by the reader and the writer when pipelined
+typedef struct ota_download_t
+{
+    esp_http_client_handle_t client;
+    ota_config_t *ota_config;
+    size_t write_offset;        // bytes of the image already accepted, the last sector_len of them are not in flash yet
+    uint8_t *sector;            // the sector being assembled, flash is only written one whole sector at a time
+    size_t sector_len;
+    uint8_t *compare_buf;       // scratch buffer for reading back the sectors already in the update partition
+    unsigned sectors_written;   // sectors erased and programmed in this run
+    unsigned sectors_skipped;   // sectors that already held the new bytes
+    size_t last_checkpoint;     // write_offset of the last checkpoint stored in NVS
+    size_t bytes_received;      // bytes received from the server in this run (all attempts)
+    size_t chunk_size;          // bytes per network read and ring slot
+    bool sweep;                 // chunk size or cipher sweep: the body is only hashed, not written as an image
+    bool sweep_program;         // chunk size sweep: whole sectors are programmed to the scratch sectors, one pass
+    size_t sweep_scratch_start; // first scratch sector, behind the installed image and any checkpoint
+    size_t sweep_scratch_offset;
+    size_t stream_offset;       // bytes of the current body consumed, resumed parts included
+    ota_delta_t *delta;         // set while a patch is being applied instead of downloading the image
+    ota_inflate_t *inflate;     // set while the body is a compressed stream
+    ota_erase_ahead_t *erase;   // set while the partition is erased ahead of the writer
+    bool payload_compressed;    // the body that completed the image was compressed
+    mbedtls_sha256_context sha; // running hash of the first write_offset bytes of the image
+    ota_progress_t progress;    // url, version, etag and length of the image being downloaded
+    char etag[OTA_ETAG_SIZE];   // ETag header of the current response
+    char content_encoding[16];  // Content-Encoding header of the current response
+    uint32_t range_total;       // total length from the Content-Range header of the current response (0 if none)
+    int64_t range_first;        // first byte position from the Content-Range header of the current response (-1 if none)
+    bool read_failed;           // the connection broke before the whole body was received
+    int64_t connected_time;     // when the last request had to open a new connection (0 if it reused one)
+    ota_metrics_t *metrics;     // timings and counters of the run, own_metrics if the caller did not ask for them
+    ota_metrics_t own_metrics;
+} ota_download_t;
+
+// the state of the connection is unknown after an error, so it is not left to the next user
 static void http_cleanup(esp_http_client_handle_t client)
 {
     esp_http_client_close(client);
-    esp_http_client_cleanup(client);
+    https_conn_release(client);
+}
+
+
+static bool ota_chunk_size_valid(uint32_t chunk_size)
+{
+    return chunk_size >= OTA_CHUNK_MIN_SIZE && chunk_size <= OTA_CHUNK_MAX_SIZE && (chunk_size & (chunk_size - 1)) == 0;
+}
+
+void ota_begin(ota_config_t *ota_config){
+    ota_config->update_partition = esp_ota_get_next_update_partition(NULL);
+    if (ota_config->update_partition == NULL)
+    {
+        ESP_LOGE(TAG, "Application Partition not found");
+        //unrecoverable error, restart the esp32
+        task_fatal_error();
+    }
+    ota_config->running_partition = esp_ota_get_running_partition();
+    if (ota_config->running_partition == NULL)
+    {
+        ESP_LOGE(TAG, "Running Partition not found");
+        //unrecoverable error, restart the esp32
+        task_fatal_error();
+    }
+    if (ota_config->update_partition == ota_config->running_partition)
+    {
+        ESP_LOGW(TAG, "Running partition is the same as the update partition probably a bug in previous versons of application bin");
+        ESP_LOGW(TAG, "will continue update process anyways");
+    }
+    ota_config->chunk_size = OTA_CHUNK_SIZE;
+    uint32_t chunk_size;
+    if (get_ota_chunk_size_nvs(&chunk_size) == 0)
+    {
+        if (ota_chunk_size_valid(chunk_size))
+        {
+            ota_config->chunk_size = chunk_size;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Ignoring invalid ota chunk size %u from NVS", (unsigned)chunk_size);
+        }
+    }
+    ESP_LOGI(TAG, "OTA chunk size: %u bytes", (unsigned)ota_config->chunk_size);
+}
+
+// only the headers needed for resuming are kept, the body is read with esp_http_client_read
+static esp_err_t ota_http_event_handler(esp_http_client_event_t *evt)
+{
+    ota_download_t *dl = (ota_download_t *)evt->user_data;
+    if (evt->event_id == HTTP_EVENT_ON_CONNECTED && dl != NULL)
+    {
+        dl->connected_time = esp_timer_get_time();
+    }
+    else if (evt->event_id == HTTP_EVENT_ON_HEADER && dl != NULL)
+    {
+        if (strcasecmp(evt->header_key, "ETag") == 0)
+        {
+            strlcpy(dl->etag, evt->header_value, sizeof(dl->etag));
+        }
+        else if (strcasecmp(evt->header_key, "Content-Encoding") == 0)
+        {
+            strlcpy(dl->content_encoding, evt->header_value, sizeof(dl->content_encoding));
+        }
+        else if (strcasecmp(evt->header_key, "Content-Range") == 0)
+        {
+            // Content-Range: bytes <first>-<last>/<total>
+            const char *total = strchr(evt->header_value, '/');
+            if (total != NULL)
+            {
+                dl->range_total = strtoul(total + 1, NULL, 10);
+            }
+            const char *first = evt->header_value;
+            while (*first != '\0' && *first != '/' && !isdigit((unsigned char)*first))
+            {
+                first++;
+            }
+            if (isdigit((unsigned char)*first))
+            {
+                dl->range_first = strtoll(first, NULL, 10);
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+// resolves the host of url ahead of the first request, so the connect time of the metrics does not include it
+static void ota_resolve_host(ota_download_t *dl, const char *url)
+{
+    dl->metrics->dns_us += https_resolve_host(url);
+}
+
+// sends the request and waits for the response headers, returns the content length like esp_http_client_fetch_headers
+static esp_err_t ota_http_open(ota_download_t *dl, int64_t *content_length)
+{
+    int64_t start_time = esp_timer_get_time();
+    dl->connected_time = 0;
+    esp_err_t err = esp_http_client_open(dl->client, 0);
+    int64_t sent_time = esp_timer_get_time();
+    dl->metrics->connect_us += sent_time - start_time;
+    dl->metrics->requests++;
+    if (dl->connected_time > 0)
+    {
+        // the client keeps the session of its first handshake (maybe the one of the version check) and offers it on every reconnect
+        bool offered = HTTPS_SAVE_CLIENT_SESSION && https_conn_handshakes(dl->client) > 1;
+        int64_t handshake_us = dl->connected_time - start_time;
+        dl->metrics->tls_handshakes++;
+        dl->metrics->tls_handshake_us += handshake_us;
+        if (offered)
+        {
+            dl->metrics->tls_sessions_offered++;
+        }
+        ESP_LOGI(TAG, "TLS handshake %u of the run: %lld ms (%s)", (unsigned)dl->metrics->tls_handshakes, handshake_us / 1000, offered ? "session offered" : "full");
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    int64_t len = esp_http_client_fetch_headers(dl->client);
+    dl->metrics->ttfb_us += esp_timer_get_time() - sent_time;
+    if (content_length != NULL)
+    {
+        *content_length = len;
+    }
+    return ESP_OK;
+}
+
+// esp_http_client_read with the latency of every call added to the metrics
+// only called by one task at a time (the reader task when pipelined)
+static int ota_http_read(ota_download_t *dl, char *buf, int len)
+{
+    int64_t start_time = esp_timer_get_time();
+    int data_read = esp_http_client_read(dl->client, buf, len);
+    uint32_t latency_us = (uint32_t)(esp_timer_get_time() - start_time);
+    ota_metrics_t *metrics = dl->metrics;
+    metrics->read_us += latency_us;
+    metrics->read_calls++;
+    if (latency_us < metrics->read_min_us)
+    {
+        metrics->read_min_us = latency_us;
+    }
+    if (latency_us > metrics->read_max_us)
+    {
+        metrics->read_max_us = latency_us;
+    }
+    if (latency_us > OTA_STALL_THRESHOLD_US)
+    {
+        metrics->stalls++;
+    }
+    return data_read;
+}
+
+#if (defined(OTA_ERASE_AHEAD) && defined(OTA_SKIP_UNCHANGED_SECTORS)) || defined(OTA_CHUNK_SWEEP)
+// sector aligned end of the image in the partition, from its segment headers only (no hashing)
+// returns 0 if there is no image and the partition size if the headers can not be read
+static size_t ota_installed_end(const esp_partition_t *partition)
+{
+    esp_image_header_t header;
+    if (esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK)
+    {
+        return partition->size;
+    }
+    if (header.magic != ESP_IMAGE_HEADER_MAGIC || header.segment_count > ESP_IMAGE_MAX_SEGMENTS)
+    {
+        return 0;
+    }
+    size_t offset = sizeof(header);
+    for (int i = 0; i < header.segment_count; i++)
+    {
+        esp_image_segment_header_t segment;
+        if (esp_partition_read(partition, offset, &segment, sizeof(segment)) != ESP_OK ||
+            segment.data_len > partition->size - offset - sizeof(segment))
+        {
+            return partition->size;
+        }
+        offset += sizeof(segment) + segment.data_len;
+    }
+    // checksum padded to 16 bytes and the appended sha256
+    offset += 16 + (header.hash_appended ? 32 : 0);
+    offset = (offset + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    return offset < partition->size ? offset : partition->size;
+}
+#endif
+
+#ifdef OTA_ERASE_AHEAD
+static void ota_erase_task(void *arg)
+{
+    ota_erase_ahead_t *erase = (ota_erase_ahead_t *)arg;
+    size_t offset = erase->start;
+    while (offset < erase->end && !erase->cancel)
+    {
+        // single sectors up to the first block boundary, whole blocks after it
+        size_t len = SPI_FLASH_SEC_SIZE;
+        if ((erase->partition->address + offset) % OTA_ERASE_BLOCK_SIZE == 0 && erase->end - offset >= OTA_ERASE_BLOCK_SIZE)
+        {
+            len = OTA_ERASE_BLOCK_SIZE;
+        }
+        esp_err_t err = esp_partition_erase_range(erase->partition, offset, len);
+        if (err != ESP_OK)
+        {
+            // the writer erases the rest itself
+            ESP_LOGW(TAG, "Erase ahead stopped at %u (%s)", (unsigned)offset, esp_err_to_name(err));
+            break;
+        }
+        offset += len;
+        __atomic_store_n(&erase->erased_end, offset, __ATOMIC_RELEASE);
+        xEventGroupSetBits(erase->events, OTA_ERASE_PROGRESS_BIT);
+    }
+    xEventGroupSetBits(erase->events, OTA_ERASE_PROGRESS_BIT | OTA_ERASE_DONE_BIT);
+    vTaskDelete(NULL);
+}
+
+// starts erasing the update partition from the end of what was written up to image_size in the background
+// with OTA_SKIP_UNCHANGED_SECTORS only the sectors behind the installed image are erased ahead,
+// the ones it covers are compared first and may not need an erase at all
+// must only be called once nothing in the partition is needed anymore (no patch, no probe)
+static void ota_erase_ahead_start(ota_download_t *dl, size_t image_size)
+{
+    const esp_partition_t *partition = dl->ota_config->update_partition;
+    size_t start = dl->write_offset - dl->sector_len;
+    size_t end = (image_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    if (end > partition->size)
+    {
+        end = partition->size;
+    }
+#ifdef OTA_SKIP_UNCHANGED_SECTORS
+    if (!dl->sweep && dl->erase == NULL)
+    {
+        size_t installed_end = ota_installed_end(partition);
+        if (start < installed_end)
+        {
+            start = installed_end;
+        }
+    }
+#endif
+    if (dl->erase != NULL || dl->sweep || start >= end)
+    {
+        return;
+    }
+    ota_erase_ahead_t *erase = (ota_erase_ahead_t *)calloc(1, sizeof(ota_erase_ahead_t));
+    if (erase == NULL)
+    {
+        return;
+    }
+    erase->partition = partition;
+    erase->start = start;
+    erase->end = end;
+    erase->erased_end = start;
+    erase->events = xEventGroupCreate();
+    if (erase->events == NULL)
+    {
+        free(erase);
+        return;
+    }
+    if (xTaskCreate(ota_erase_task, "ota_erase", OTA_ERASE_TASK_STACK_SIZE, erase, OTA_TASK_PRIORITY, NULL) != pdPASS)
+    {
+        // not fatal, the writer erases every sector itself
+        ESP_LOGW(TAG, "Failed to create the erase ahead task");
+        vEventGroupDelete(erase->events);
+        free(erase);
+        return;
+    }
+    dl->erase = erase;
+    ESP_LOGI(TAG, "Erasing bytes %u-%u of the update partition ahead of the download", (unsigned)start, (unsigned)end);
+}
+
+// expected length of the image: from the manifest, or from the server if the image is not compressed
+static size_t ota_image_size_hint(const ota_download_t *dl, const ota_manifest_t *manifest)
+{
+    if (manifest != NULL && manifest->image_size > 0)
+    {
+        return manifest->image_size;
+    }
+    return dl->inflate == NULL ? dl->progress.total_length : 0;
+}
+
+// waits until the erase task is gone, what it erased so far is left as it is
+static void ota_erase_ahead_stop(ota_download_t *dl)
+{
+    ota_erase_ahead_t *erase = dl->erase;
+    if (erase == NULL)
+    {
+        return;
+    }
+    erase->cancel = true;
+    xEventGroupWaitBits(erase->events, OTA_ERASE_DONE_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    vEventGroupDelete(erase->events);
+    free(erase);
+    dl->erase = NULL;
+}
+
+// returns true once the sector at offset was erased by the erase ahead task
+// returns false if it is not going to be, then the writer has to erase it
+static bool ota_erase_ahead_wait(ota_download_t *dl, size_t offset)
+{
+    ota_erase_ahead_t *erase = dl->erase;
+    if (erase == NULL || offset < erase->start || offset >= erase->end)
+    {
+        return false;
+    }
+    while (__atomic_load_n(&erase->erased_end, __ATOMIC_ACQUIRE) <= offset &&
+           (xEventGroupGetBits(erase->events) & OTA_ERASE_DONE_BIT) == 0)
+    {
+        xEventGroupWaitBits(erase->events, OTA_ERASE_PROGRESS_BIT, pdTRUE, pdFALSE, portMAX_DELAY);
+    }
+    return __atomic_load_n(&erase->erased_end, __ATOMIC_ACQUIRE) > offset;
+}
+#else
+#define ota_erase_ahead_start(dl, image_size)
+#define ota_erase_ahead_stop(dl)
+#define ota_erase_ahead_wait(dl, offset) false
+#endif
+
+// stores the download progress in NVS every OTA_CHECKPOINT_INTERVAL bytes
+// only done on sector boundaries so a resume never has to erase a sector that holds valid data
+static void ota_checkpoint(ota_download_t *dl, bool force)
+{
+    // the decompressor state is lost on restart, so a later run could not continue a compressed stream
+    if (dl->inflate != NULL)
+    {
+        return;
+    }
+    if (dl->write_offset % SPI_FLASH_SEC_SIZE != 0 || dl->write_offset == dl->last_checkpoint)
+    {
+        return;
+    }
+    if (!force && dl->write_offset - dl->last_checkpoint < OTA_CHECKPOINT_INTERVAL)
+    {
+        return;
+    }
+    // the running hash keeps going, so finish a copy of it
+    mbedtls_sha256_context prefix_sha;
+    mbedtls_sha256_init(&prefix_sha);
+    mbedtls_sha256_clone(&prefix_sha, &dl->sha);
+    mbedtls_sha256_finish(&prefix_sha, dl->progress.sha256);
+    mbedtls_sha256_free(&prefix_sha);
+    dl->progress.bytes_written = dl->write_offset;
+
+    esp_err_t err = set_ota_progress_nvs(&dl->progress);
+    if (err != ESP_OK)
+    {
+        // not fatal, a later run will just resume from an older checkpoint
+        ESP_LOGW(TAG, "Failed to store ota checkpoint (%s)", esp_err_to_name(err));
+        return;
+    }
+    dl->last_checkpoint = dl->write_offset;
+    ESP_LOGD(TAG, "Stored ota checkpoint at %u bytes", (unsigned)dl->write_offset);
+}
+
+// forgets everything written so far, the next chunk will be written at the start of the partition
+static void ota_download_restart(ota_download_t *dl)
+{
+    // the erased region started after what was written before, and parts of it may be written now
+    ota_erase_ahead_stop(dl);
+    dl->write_offset = 0;
+    dl->sector_len = 0;
+    dl->last_checkpoint = 0;
+    dl->stream_offset = 0;
+    if (dl->inflate != NULL)
+    {
+        ota_inflate_reset(dl->inflate);
+    }
+    mbedtls_sha256_free(&dl->sha);
+    mbedtls_sha256_init(&dl->sha);
+    mbedtls_sha256_starts(&dl->sha, 0);
+    clear_ota_progress_nvs();
+}
+
+// rebuilds the running hash from the bytes already in the update partition and compares it with the checkpoint
+// returns true if the download can continue at saved->bytes_written
+static bool ota_restore_checkpoint(ota_download_t *dl, const ota_progress_t *saved)
+{
+    const esp_partition_t *partition = dl->ota_config->update_partition;
+    if (saved->bytes_written == 0 || saved->bytes_written % SPI_FLASH_SEC_SIZE != 0 || saved->bytes_written > partition->size)
+    {
+        return false;
+    }
+    // nothing is assembled yet, so the sector buffer doubles as read buffer
+    for (size_t offset = 0; offset < saved->bytes_written; offset += SPI_FLASH_SEC_SIZE)
+    {
+        if (esp_partition_read(partition, offset, dl->sector, SPI_FLASH_SEC_SIZE) != ESP_OK)
+        {
+            ota_download_restart(dl);
+            return false;
+        }
+        mbedtls_sha256_update(&dl->sha, dl->sector, SPI_FLASH_SEC_SIZE);
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_context prefix_sha;
+    mbedtls_sha256_init(&prefix_sha);
+    mbedtls_sha256_clone(&prefix_sha, &dl->sha);
+    mbedtls_sha256_finish(&prefix_sha, digest);
+    mbedtls_sha256_free(&prefix_sha);
+    if (memcmp(digest, saved->sha256, sizeof(digest)) != 0)
+    {
+        ESP_LOGW(TAG, "Update partition does not match the ota checkpoint");
+        ota_download_restart(dl);
+        return false;
+    }
+
+    memcpy(&dl->progress, saved, sizeof(ota_progress_t));
+    dl->write_offset = saved->bytes_written;
+    dl->last_checkpoint = saved->bytes_written;
+    return true;
+}
+
+bool ota_resume_pending(const char *version_buf)
+{
+    ota_progress_t saved;
+    if (version_buf == NULL || get_ota_progress_nvs(&saved) != 0)
+    {
+        return false;
+    }
+    return saved.bytes_written > 0 && strcmp(saved.version, version_buf) == 0;
+}
+
+#ifdef OTA_SKIP_UNCHANGED_SECTORS
+// returns true if the update partition already holds these bytes at offset
+// compared piece by piece, most changed sectors differ within the first piece
+static bool ota_sector_unchanged(ota_download_t *dl, size_t offset, const uint8_t *data, size_t len)
+{
+    for (size_t done = 0; done < len; done += OTA_SKIP_COMPARE_SIZE)
+    {
+        size_t n = len - done < OTA_SKIP_COMPARE_SIZE ? len - done : OTA_SKIP_COMPARE_SIZE;
+        if (esp_partition_read(dl->ota_config->update_partition, offset + done, dl->compare_buf, n) != ESP_OK ||
+            memcmp(dl->compare_buf, data + done, n) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// erases and programs one sector (or the last part of the image) at a sector aligned offset
+// the image header is checked on the first sector, so it always sees decompressed bytes
+static esp_err_t ota_program_sector(ota_download_t *dl, size_t offset, const uint8_t *data, size_t len)
+{
+    const esp_partition_t *partition = dl->ota_config->update_partition;
+    if (offset == 0)
+    {
+        // will check the header of the image before anything is erased
+        if (len <= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t) ||
+            data[0] != ESP_IMAGE_HEADER_MAGIC)
+        {
+            ESP_LOGE(TAG, "first received package is not fit len (too small) or is not an app image");
+            return ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+        esp_app_desc_t new_app_info;
+        memcpy(&new_app_info, &data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
+        ESP_LOGI(TAG, "Downloading firmware version: %s", new_app_info.version);
+    }
+    esp_err_t err;
+    // a sector erased ahead is behind the installed image, nothing to compare with
+    bool erased = ota_erase_ahead_wait(dl, offset);
+#ifdef OTA_SKIP_UNCHANGED_SECTORS
+    if (!erased && ota_sector_unchanged(dl, offset, data, len))
+    {
+        dl->sectors_skipped++;
+        return ESP_OK;
+    }
+#endif
+    if (!erased)
+    {
+        err = esp_partition_erase_range(partition, offset, SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to erase update partition (%s)", esp_err_to_name(err));
+            return err;
+        }
+    }
+    err = esp_partition_write(partition, offset, data, len);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to write update partition (%s)", esp_err_to_name(err));
+        return err;
+    }
+    dl->sectors_written++;
+    return ESP_OK;
+}
+
+static esp_err_t ota_write_sector(ota_download_t *dl, size_t offset, const uint8_t *data, size_t len)
+{
+    https_heap_sample();
+    int64_t start_time = esp_timer_get_time();
+    esp_err_t err = ota_program_sector(dl, offset, data, len);
+    dl->metrics->flash_us += esp_timer_get_time() - start_time;
+    return err;
+}
+
+// appends the chunk to the image
+// whole sectors go to flash straight from data, the rest is collected in dl->sector
+static esp_err_t ota_write_chunk(ota_download_t *dl, const char *data, size_t data_len)
+{
+    esp_err_t err;
+    if (dl->write_offset + data_len > dl->ota_config->update_partition->size)
+    {
+        ESP_LOGE(TAG, "Image does not fit in the update partition");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    while (data_len > 0)
+    {
+        size_t n;
+        if (dl->sector_len == 0 && data_len >= SPI_FLASH_SEC_SIZE)
+        {
+            n = SPI_FLASH_SEC_SIZE;
+            err = ota_write_sector(dl, dl->write_offset, (const uint8_t *)data, n);
+        }
+        else
+        {
+            n = SPI_FLASH_SEC_SIZE - dl->sector_len;
+            if (n > data_len)
+            {
+                n = data_len;
+            }
+            memcpy(dl->sector + dl->sector_len, data, n);
+            dl->sector_len += n;
+            err = ESP_OK;
+            if (dl->sector_len == SPI_FLASH_SEC_SIZE)
+            {
+                err = ota_write_sector(dl, dl->write_offset + n - SPI_FLASH_SEC_SIZE, dl->sector, SPI_FLASH_SEC_SIZE);
+                dl->sector_len = 0;
+            }
+        }
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        mbedtls_sha256_update(&dl->sha, (const unsigned char *)data, n);
+        dl->write_offset += n;
+        data += n;
+        data_len -= n;
+        ota_checkpoint(dl, false);
+    }
+    return ESP_OK;
+}
+
+// writes the last partial sector of the image
+static esp_err_t ota_write_flush(ota_download_t *dl)
+{
+    if (dl->sector_len == 0)
+    {
+        return ESP_OK;
+    }
+    esp_err_t err = ota_write_sector(dl, dl->write_offset - dl->sector_len, dl->sector, dl->sector_len);
+    dl->sector_len = 0;
+    return err;
+}
+
+static esp_err_t ota_delta_write(void *ctx, const char *data, size_t len)
+{
+    return ota_write_chunk((ota_download_t *)ctx, data, len);
+}
+
+// passes decompressed bytes to the patch decoder when applying a delta, straight to flash otherwise
+static esp_err_t ota_decode(ota_download_t *dl, const char *data, size_t data_len)
+{
+    if (dl->delta != NULL)
+    {
+        return ota_delta_feed(dl->delta, (const uint8_t *)data, data_len);
+    }
+    return ota_write_chunk(dl, data, data_len);
+}
+
+static esp_err_t ota_inflate_write(void *ctx, const char *data, size_t len)
+{
+    return ota_decode((ota_download_t *)ctx, data, len);
+}
+
+#ifdef OTA_CHUNK_SWEEP
+// programs the received bytes to the scratch sectors of the update partition, so each chunk size
+// pays the erase and program time of a real download, the installed image and a checkpoint stay intact
+// the scratch sectors are programmed once and not again, the rest of the image is only received
+static esp_err_t ota_sweep_program(ota_download_t *dl, const char *data, size_t data_len)
+{
+    const esp_partition_t *partition = dl->ota_config->update_partition;
+    while (dl->sweep_program && data_len > 0 && dl->sweep_scratch_offset + SPI_FLASH_SEC_SIZE <= partition->size)
+    {
+        size_t n = SPI_FLASH_SEC_SIZE - dl->sector_len < data_len ? SPI_FLASH_SEC_SIZE - dl->sector_len : data_len;
+        memcpy(dl->sector + dl->sector_len, data, n);
+        dl->sector_len += n;
+        data += n;
+        data_len -= n;
+        if (dl->sector_len < SPI_FLASH_SEC_SIZE)
+        {
+            break;
+        }
+        int64_t flash_start_time = esp_timer_get_time();
+        esp_err_t err = esp_partition_erase_range(partition, dl->sweep_scratch_offset, SPI_FLASH_SEC_SIZE);
+        if (err == ESP_OK)
+        {
+            err = esp_partition_write(partition, dl->sweep_scratch_offset, dl->sector, SPI_FLASH_SEC_SIZE);
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to program a scratch sector for the sweep (%s)", esp_err_to_name(err));
+            return err;
+        }
+        dl->metrics->flash_us += esp_timer_get_time() - flash_start_time;
+        dl->sweep_scratch_offset += SPI_FLASH_SEC_SIZE;
+        dl->sectors_written++;
+        dl->sector_len = 0;
+    }
+    return ESP_OK;
+}
+
+// first sector behind the installed image and behind what a checkpoint still needs
+// returns the partition size if there is no room for OTA_SWEEP_MIN_SCRATCH_SECTORS scratch sectors
+static size_t ota_sweep_scratch_start(const esp_partition_t *partition)
+{
+    size_t start = ota_installed_end(partition);
+    ota_progress_t saved;
+    if (get_ota_progress_nvs(&saved) == 0 && saved.bytes_written > start)
+    {
+        start = (saved.bytes_written + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    }
+    return start + OTA_SWEEP_MIN_SCRATCH_SECTORS * SPI_FLASH_SEC_SIZE <= partition->size ? start : partition->size;
+}
+#else
+#define ota_sweep_program(dl, data, data_len) ESP_OK
+#endif
+
+// received bytes go through the decompressor first if the body is compressed
+static esp_err_t ota_consume(ota_download_t *dl, const char *data, size_t data_len)
+{
+    dl->bytes_received += data_len;
+    dl->stream_offset += data_len;
+    if (dl->sweep)
+    {
+        mbedtls_sha256_update(&dl->sha, (const unsigned char *)data, data_len);
+        https_heap_sample();
+        return ota_sweep_program(dl, data, data_len);
+    }
+    // the connection, the ring and the decompressor are all allocated while data arrives
+    https_heap_sample();
+    if (dl->inflate != NULL)
+    {
+        return ota_inflate_feed(dl->inflate, (const uint8_t *)data, data_len);
+    }
+    return ota_decode(dl, data, data_len);
+}
+
+// "zlib" in the manifest and "deflate" as Content-Encoding both mean a zlib stream
+static bool ota_encoding_is_zlib(const char *encoding)
+{
+    if (encoding == NULL || encoding[0] == '\0' || strcasecmp(encoding, "identity") == 0)
+    {
+        return false;
+    }
+    if (strcasecmp(encoding, "zlib") == 0 || strcasecmp(encoding, "deflate") == 0)
+    {
+        return true;
+    }
+    ESP_LOGW(TAG, "Unsupported encoding %s, treating the body as raw", encoding);
+    return false;
+}
+
+static ota_inflate_t *ota_decompressor_create(ota_download_t *dl)
+{
+    ota_inflate_t *inflate = (ota_inflate_t *)calloc(1, sizeof(ota_inflate_t));
+    if (inflate == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for the decompressor");
+        return NULL;
+    }
+    if (ota_inflate_init(inflate, ota_inflate_write, dl) != ESP_OK)
+    {
+        free(inflate);
+        return NULL;
+    }
+    return inflate;
+}
+
+static void ota_decompressor_destroy(ota_inflate_t *inflate)
+{
+    if (inflate != NULL)
+    {
+        ota_inflate_free(inflate);
+        free(inflate);
+    }
+}
+
+// opens the connection asking only for the missing bytes if part of the image is already written
+// returns ESP_OK if the body continues at dl->write_offset (at dl->stream_offset of the compressed stream)
+// returns ESP_ERR_INVALID_VERSION if the image changed on the server or the range does not start at the resume offset,
+// then the download has to start from scratch
+static esp_err_t ota_open_connection(ota_download_t *dl)
+{
+    esp_http_client_handle_t client = dl->client;
+    dl->etag[0] = '\0';
+    dl->content_encoding[0] = '\0';
+    dl->range_total = 0;
+    dl->range_first = -1;
+    dl->read_failed = false;
+
+    // ranges of a compressed image count compressed bytes
+    size_t resume_offset = dl->inflate != NULL ? dl->stream_offset : dl->write_offset;
+    if (resume_offset > 0)
+    {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%u-", (unsigned)resume_offset);
+        esp_http_client_set_header(client, "Range", range);
+        // with If-Range the server sends the whole image (200) if it is not the same one anymore
+        if (dl->progress.etag[0] != '\0')
+        {
+            esp_http_client_set_header(client, "If-Range", dl->progress.etag);
+        }
+    }
+    else
+    {
+        esp_http_client_delete_header(client, "Range");
+        esp_http_client_delete_header(client, "If-Range");
+    }
+
+    int64_t content_length = 0;
+    esp_err_t err = ota_http_open(dl, &content_length);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        return err;
+    }
+    int status_code = esp_http_client_get_status_code(client);
+    bool deflate_encoded = ota_encoding_is_zlib(dl->content_encoding);
+
+    if (status_code == 206 && resume_offset > 0)
+    {
+        if (deflate_encoded && dl->inflate == NULL)
+        {
+            ESP_LOGW(TAG, "Server sent a range of a compressed image -> restarting download from scratch");
+            return ESP_ERR_INVALID_VERSION;
+        }
+        // a proxy may answer another part of the range, those bytes do not belong at write_offset
+        if (dl->range_first != (int64_t)resume_offset)
+        {
+            ESP_LOGW(TAG, "Server sent a range starting at %lld instead of %u -> restarting download from scratch",
+                     dl->range_first, (unsigned)resume_offset);
+            return ESP_ERR_INVALID_VERSION;
+        }
+        // ETag and length are unknown if the first part of the image came from a patch
+        bool etag_changed = dl->progress.etag[0] != '\0' && strcmp(dl->etag, dl->progress.etag) != 0;
+        bool length_changed = dl->progress.total_length != 0 && dl->range_total != dl->progress.total_length;
+        if (etag_changed || length_changed)
+        {
+            ESP_LOGW(TAG, "Image changed on the server (ETag or length) -> restarting download from scratch");
+            return ESP_ERR_INVALID_VERSION;
+        }
+        if (dl->progress.etag[0] == '\0')
+        {
+            strlcpy(dl->progress.etag, dl->etag, sizeof(dl->progress.etag));
+        }
+        dl->progress.total_length = dl->range_total;
+        ESP_LOGI(TAG, "Resuming ota download at %u of %u bytes", (unsigned)resume_offset, (unsigned)dl->progress.total_length);
+        return ESP_OK;
+    }
+    if (status_code == 200)
+    {
+        if (resume_offset > 0)
+        {
+            // the server ignored the range or the If-Range did not match
+            ESP_LOGW(TAG, "Server sent the whole image -> restarting download from scratch");
+            ota_download_restart(dl);
+        }
+        if (deflate_encoded && dl->inflate == NULL)
+        {
+            dl->inflate = ota_decompressor_create(dl);
+            if (dl->inflate == NULL)
+            {
+                return ESP_ERR_NO_MEM;
+            }
+            ESP_LOGI(TAG, "Server sent a compressed image (Content-Encoding: %s)", dl->content_encoding);
+        }
+        strlcpy(dl->progress.etag, dl->etag, sizeof(dl->progress.etag));
+        dl->progress.total_length = content_length > 0 ? (uint32_t)content_length : 0;
+        return ESP_OK;
+    }
+    ESP_LOGE(TAG, "Unexpected HTTP status %d for the firmware download", status_code);
+    return ESP_FAIL;
+}
+
+#if !OTA_USE_PIPELINE
+// reads a chunk and writes it to flash before reading the next one
+// returns an error only if writing to flash failed, network errors are flagged in dl->read_failed
+static esp_err_t ota_download_serial(ota_download_t *dl)
+{
+    char *ota_write_data = (char *)aligned_alloc(4, dl->chunk_size);
+    if (ota_write_data == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for the ota chunk");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_OK;
+    while (1)
+    {
+        // reads the data from the server and writes to the ota partition in chunks of size chunk_size
+        int data_read = ota_http_read(dl, ota_write_data, dl->chunk_size);
+        if (data_read < 0)
+        {
+            ESP_LOGE(TAG, "Error: SSL data read error");
+            dl->read_failed = true;
+            break;
+        }
+        else if (data_read > 0)
+        {
+            err = ota_consume(dl, ota_write_data, data_read);
+            if (err != ESP_OK)
+            {
+                break;
+            }
+            ESP_LOGD(TAG, "Written image length %d", (int)dl->write_offset);
+        }
+        else if (data_read == 0)
+        {
+            /*
+             * As esp_http_client_read never returns negative error code, we rely on
+             * `errno` to check for underlying transport connectivity closure if any
+             */
+            if (errno == ECONNRESET || errno == ENOTCONN)
+            {
+                ESP_LOGE(TAG, "Connection closed, errno = %d", errno);
+                dl->read_failed = true;
+                break;
+            }
+            if (esp_http_client_is_complete_data_received(dl->client) == true)
+            {
+                ESP_LOGI(TAG, "Connection closed");
+                break;
+            }
+        }
+    }
+    free(ota_write_data);
+    return err;
+}
+
+#else
+
+#define OTA_READER_DONE_BIT BIT0
+#define OTA_WRITER_DONE_BIT BIT1
+
+// state shared by the network reader and the flash writer tasks
+typedef struct ota_pipe_t
+{
+    ota_download_t *dl;
+    ota_ring_t ring;
+    EventGroupHandle_t done_event_group;
+    volatile esp_err_t write_err; // set by the writer, makes the reader stop early
+} ota_pipe_t;
+
+// producer: fills whole ring slots with data from the server
+static void ota_reader_task(void *arg)
+{
+    ota_pipe_t *pipe = (ota_pipe_t *)arg;
+    ota_download_t *dl = pipe->dl;
+    // wait until ota_update has attached both tasks to the ring
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    bool finished = false;
+    while (!finished && pipe->write_err == ESP_OK)
+    {
+        uint8_t *slot = ota_ring_acquire_write(&pipe->ring);
+        size_t filled = 0;
+        while (filled < pipe->ring.slot_size)
+        {
+            int data_read = ota_http_read(dl, (char *)slot + filled, pipe->ring.slot_size - filled);
+            if (data_read < 0)
+            {
+                ESP_LOGE(TAG, "Error: SSL data read error");
+                dl->read_failed = true;
+                finished = true;
+                break;
+            }
+            else if (data_read > 0)
+            {
+                filled += data_read;
+            }
+            else
+            {
+                // same as in ota_download_serial, errno tells us if the transport was closed
+                if (errno == ECONNRESET || errno == ENOTCONN)
+                {
+                    ESP_LOGE(TAG, "Connection closed, errno = %d", errno);
+                    dl->read_failed = true;
+                    finished = true;
+                    break;
+                }
+                if (esp_http_client_is_complete_data_received(dl->client) == true)
+                {
+                    ESP_LOGI(TAG, "Connection closed");
+                    finished = true;
+                    break;
+                }
+            }
+        }
+        // whatever was received before an error is still valid data
+        if (filled > 0)
+        {
+            ota_ring_commit_write(&pipe->ring, filled);
+        }
+    }
+    ota_ring_close(&pipe->ring);
+    xEventGroupSetBits(pipe->done_event_group, OTA_READER_DONE_BIT);
+    vTaskDelete(NULL);
+}
+
+// consumer: writes the filled ring slots to the update partition
+static void ota_writer_task(void *arg)
+{
+    ota_pipe_t *pipe = (ota_pipe_t *)arg;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    ota_ring_slot_t *slot;
+    while ((slot = ota_ring_acquire_read(&pipe->ring)) != NULL)
+    {
+        // after a failed write the ring is only drained so the reader can finish
+        if (pipe->write_err == ESP_OK)
+        {
+            pipe->write_err = ota_consume(pipe->dl, (const char *)slot->data, slot->len);
+            ESP_LOGD(TAG, "Written image length %d", (int)pipe->dl->write_offset);
+        }
+        ota_ring_release_read(&pipe->ring);
+    }
+    xEventGroupSetBits(pipe->done_event_group, OTA_WRITER_DONE_BIT);
+    vTaskDelete(NULL);
+}
+
+// reads on OTA_NET_CORE and writes to flash on OTA_FLASH_CORE at the same time
+// returns an error only if writing to flash failed, network errors are flagged in dl->read_failed
+static esp_err_t ota_download_pipelined(ota_download_t *dl)
+{
+    ota_pipe_t pipe = {
+        .dl = dl,
+        .write_err = ESP_OK,
+    };
+    esp_err_t err = ota_ring_init(&pipe.ring, dl->chunk_size);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    pipe.done_event_group = xEventGroupCreate();
+    if (pipe.done_event_group == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create ota event group");
+        ota_ring_free(&pipe.ring);
+        return ESP_ERR_NO_MEM;
+    }
+
+    TaskHandle_t reader = NULL;
+    TaskHandle_t writer = NULL;
+    if (xTaskCreatePinnedToCore(ota_reader_task, "ota_reader", OTA_TASK_STACK_SIZE, &pipe, OTA_TASK_PRIORITY, &reader, OTA_NET_CORE) != pdPASS ||
+        xTaskCreatePinnedToCore(ota_writer_task, "ota_writer", OTA_TASK_STACK_SIZE, &pipe, OTA_TASK_PRIORITY, &writer, OTA_FLASH_CORE) != pdPASS)
+    {
+        // the tasks wait for the start notification, so one created alone can not touch the ring
+        ESP_LOGE(TAG, "Failed to create ota reader/writer tasks");
+        http_cleanup(dl->client);
+        task_fatal_error();
+    }
+    ota_ring_attach(&pipe.ring, reader, writer);
+    xTaskNotifyGive(reader);
+    xTaskNotifyGive(writer);
+
+    xEventGroupWaitBits(pipe.done_event_group, OTA_READER_DONE_BIT | OTA_WRITER_DONE_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    vEventGroupDelete(pipe.done_event_group);
+    ota_ring_free(&pipe.ring);
+    return pipe.write_err;
+}
+#endif
+
+#if OTA_USE_PIPELINE
+#define ota_download(dl) ota_download_pipelined(dl)
+#else
+#define ota_download(dl) ota_download_serial(dl)
+#endif
+
+// downloads the patch from delta_url and applies it to the image installed in the update partition
+// returns ESP_OK if the whole new image was written, on any error the full image has to be downloaded
+static esp_err_t ota_apply_delta(ota_download_t *dl, const char *delta_url, bool compressed)
+{
+    esp_http_client_handle_t client = dl->client;
+    esp_http_client_set_url(client, delta_url);
+    esp_http_client_delete_header(client, "Range");
+    esp_http_client_delete_header(client, "If-Range");
+    dl->content_encoding[0] = '\0';
+    esp_err_t err = ota_http_open(dl, NULL);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to open HTTP connection for the patch: %s", esp_err_to_name(err));
+        return err;
+    }
+    if (esp_http_client_get_status_code(client) != 200)
+    {
+        ESP_LOGE(TAG, "Unexpected HTTP status %d for the patch download", esp_http_client_get_status_code(client));
+        esp_http_client_close(client);
+        return ESP_FAIL;
+    }
+
+    ota_delta_t *delta = (ota_delta_t *)calloc(1, sizeof(ota_delta_t));
+    if (delta == NULL)
+    {
+        esp_http_client_close(client);
+        return ESP_ERR_NO_MEM;
+    }
+    // the decoder checks the installed image against the patch header before anything is overwritten
+    err = ota_delta_init(delta, dl->ota_config->update_partition, ota_delta_write, dl);
+    ota_inflate_t *inflate = NULL;
+    if (err == ESP_OK && (compressed || ota_encoding_is_zlib(dl->content_encoding)))
+    {
+        inflate = ota_decompressor_create(dl);
+        if (inflate == NULL)
+        {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    if (err == ESP_OK)
+    {
+        dl->read_failed = false;
+        dl->stream_offset = 0;
+        ota_inflate_t *image_inflate = dl->inflate;
+        dl->delta = delta;
+        dl->inflate = inflate;
+        dl->payload_compressed = inflate != NULL;
+        err = ota_download(dl);
+        dl->delta = NULL;
+        dl->inflate = image_inflate;
+        dl->stream_offset = 0;
+        if (err == ESP_OK && (dl->read_failed || esp_http_client_is_complete_data_received(client) != true))
+        {
+            // only the connection broke, what was written so far is fine
+            ESP_LOGE(TAG, "Error in receiving complete patch");
+            err = ESP_FAIL;
+        }
+        else
+        {
+            if (err == ESP_OK && inflate != NULL)
+            {
+                err = ota_inflate_finish(inflate);
+            }
+            if (err == ESP_OK)
+            {
+                err = ota_delta_finish(delta);
+            }
+            if (err != ESP_OK)
+            {
+                // the patch itself is broken, what it produced so far can not be trusted
+                ota_download_restart(dl);
+            }
+        }
+    }
+    ota_decompressor_destroy(inflate);
+    ota_delta_free(delta);
+    free(delta);
+    esp_http_client_close(client);
+    return err;
+}
+
+// takes the kept client of the image host (still connected if the version check used the same host)
+// the headers of every response are passed to ota_http_event_handler with dl
+static esp_http_client_handle_t ota_client_init(ota_download_t *dl, const https_creds_t *creds, char *url_buf)
+{
+    esp_http_client_handle_t client = https_conn_get(url_buf, creds);
+    if (client == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to initialise HTTP connection");
+        task_fatal_error();
+    }
+    https_conn_set_handler(client, ota_http_event_handler, dl);
+    esp_http_client_set_timeout_ms(client, OTA_RECV_TIMEOUT);
+    dl->client = client;
+    return client;
+}
+
+#ifdef OTA_PROBE_INSTALLED
+// fetches the first OTA_PROBE_SIZE bytes of the image with a Range request and compares its app description
+// with the one of the image in the update partition, returns true if both are the same build
+// the bytes read are passed to the writer like any other, so on a mismatch the download continues after them
+// (on the same connection) and *body_open tells if the server ignored the range and the whole image is still coming
+static bool ota_probe_installed(ota_download_t *dl, bool *body_open)
+{
+    esp_http_client_handle_t client = dl->client;
+    *body_open = false;
+    esp_app_desc_t installed;
+    if (esp_ota_get_partition_description(dl->ota_config->update_partition, &installed) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "No valid image in the update partition, nothing to probe");
+        return false;
+    }
+
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=0-%u", (unsigned)(OTA_PROBE_SIZE - 1));
+    esp_http_client_set_header(client, "Range", range);
+    esp_http_client_delete_header(client, "If-Range");
+    dl->etag[0] = '\0';
+    dl->content_encoding[0] = '\0';
+    dl->range_total = 0;
+    dl->range_first = -1;
+    dl->read_failed = false;
+    int64_t content_length = 0;
+    if (ota_http_open(dl, &content_length) != ESP_OK)
+    {
+        // the download opens its own connection
+        ESP_LOGW(TAG, "Failed to open HTTP connection for the probe");
+        return false;
+    }
+    int status_code = esp_http_client_get_status_code(client);
+    if ((status_code != 206 && status_code != 200) || (status_code == 206 && dl->range_first != 0) ||
+        (ota_encoding_is_zlib(dl->content_encoding) && dl->inflate == NULL))
+    {
+        ESP_LOGW(TAG, "Probe not possible (HTTP status %d)", status_code);
+        esp_http_client_close(client);
+        return false;
+    }
+
+    char probe[OTA_PROBE_SIZE];
+    int probe_len = 0;
+    while (probe_len < OTA_PROBE_SIZE)
+    {
+        int data_read = ota_http_read(dl, probe + probe_len, OTA_PROBE_SIZE - probe_len);
+        if (data_read <= 0)
+        {
+            break;
+        }
+        probe_len += data_read;
+    }
+    if (probe_len < OTA_PROBE_SIZE || ota_consume(dl, probe, probe_len) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to read the start of the image for the probe");
+        ota_download_restart(dl);
+        esp_http_client_close(client);
+        return false;
+    }
+    strlcpy(dl->progress.etag, dl->etag, sizeof(dl->progress.etag));
+    if (status_code == 206)
+    {
+        dl->progress.total_length = dl->range_total;
+    }
+    else
+    {
+        dl->progress.total_length = content_length > 0 ? (uint32_t)content_length : 0;
+        *body_open = true;
+    }
+
+    // the decompressed start of a compressed image may be shorter than the probe
+    size_t desc_offset = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+    if (dl->sector_len < desc_offset + sizeof(esp_app_desc_t) || dl->sector[0] != ESP_IMAGE_HEADER_MAGIC)
+    {
+        return false;
+    }
+    esp_app_desc_t remote;
+    memcpy(&remote, dl->sector + desc_offset, sizeof(esp_app_desc_t));
+    if (memcmp(remote.app_elf_sha256, installed.app_elf_sha256, sizeof(installed.app_elf_sha256)) != 0 ||
+        strncmp(remote.version, installed.version, sizeof(installed.version)) != 0 ||
+        strncmp(remote.project_name, installed.project_name, sizeof(installed.project_name)) != 0)
+    {
+        ESP_LOGI(TAG, "Update partition holds %s %s, server image is %s %s", installed.project_name, installed.version, remote.project_name, remote.version);
+        return false;
+    }
+    esp_http_client_close(client);
+    return true;
 }
+#endif
 
+static int ota_hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    c = tolower((unsigned char)c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
 
-void ota_begin(ota_config_t *ota_config){
-    ota_config->update_handle = 0;
-    ota_config->update_partition = esp_ota_get_next_update_partition(NULL);
-    if (ota_config->update_partition == NULL)
+// checks an image hash against the sha256 of the manifest and its signature
+// *checked is false if there was nothing to check it against (no digest in the manifest and no signing key)
+static esp_err_t ota_check_manifest_digest(const uint8_t digest[32], const ota_manifest_t *manifest, bool *checked)
+{
+    *checked = false;
+    mbedtls_pk_context key;
+    mbedtls_pk_init(&key);
+    // EMBED_TXTFILES adds the terminating null mbedtls needs for PEM
+    bool have_key = mbedtls_pk_parse_public_key(&key, otasignkey_start, otasignkey_end - otasignkey_start) == 0;
+    const char *sha256 = manifest != NULL && manifest->sha256[0] != '\0' ? manifest->sha256 : NULL;
+    const char *signature = manifest != NULL && manifest->signature[0] != '\0' ? manifest->signature : NULL;
+    esp_err_t err = ESP_OK;
+    if (sha256 == NULL)
     {
-        ESP_LOGE(TAG, "Application Partition not found");
-        //unrecoverable error, restart the esp32
-        task_fatal_error();
+        if (have_key)
+        {
+            ESP_LOGE(TAG, "Manifest has no sha256 but images have to be signed");
+            err = ESP_ERR_OTA_VALIDATE_FAILED;
+        }
+        goto cleanup;
     }
-    ota_config->running_partition = esp_ota_get_running_partition();
-    if (ota_config->running_partition == NULL)
+
+    uint8_t expected[32];
+    bool valid_hex = strlen(sha256) == 2 * sizeof(expected);
+    for (int i = 0; valid_hex && i < sizeof(expected); i++)
     {
-        ESP_LOGE(TAG, "Running Partition not found");
-        //unrecoverable error, restart the esp32
-        task_fatal_error();
+        int hi = ota_hex_value(sha256[2 * i]);
+        int lo = ota_hex_value(sha256[2 * i + 1]);
+        valid_hex = hi >= 0 && lo >= 0;
+        expected[i] = (uint8_t)((hi << 4) | lo);
     }
-    if (ota_config->update_partition == ota_config->running_partition)
+    if (!valid_hex)
     {
-        ESP_LOGW(TAG, "Running partition is the same as the update partition probably a bug in previous versons of application bin");
-        ESP_LOGW(TAG, "will continue update process anyways");
+        ESP_LOGE(TAG, "Manifest sha256 is not 64 hex digits");
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+        goto cleanup;
     }
+    if (memcmp(digest, expected, sizeof(expected)) != 0)
+    {
+        ESP_LOGE(TAG, "Image sha256 does not match the manifest");
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+        goto cleanup;
+    }
+
+    if (!have_key)
+    {
+        ESP_LOGW(TAG, "No image signing key built in, only the sha256 of the manifest was checked");
+        *checked = true;
+        goto cleanup;
+    }
+    if (signature == NULL)
+    {
+        ESP_LOGE(TAG, "Manifest has no signature but images have to be signed");
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+        goto cleanup;
+    }
+    unsigned char sig[MBEDTLS_PK_SIGNATURE_MAX_SIZE];
+    size_t sig_len = 0;
+    if (mbedtls_base64_decode(sig, sizeof(sig), &sig_len, (const unsigned char *)signature, strlen(signature)) != 0 ||
+        mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, 32, sig, sig_len) != 0)
+    {
+        ESP_LOGE(TAG, "Image signature is not valid");
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+        goto cleanup;
+    }
+    *checked = true;
+
+cleanup:
+    mbedtls_pk_free(&key);
+    return err;
 }
 
-static char ota_write_data[OTA_BUFFSIZE + 1] = { 0 };
-esp_err_t ota_update(char* cert_buf,char* key_buf,char* url_buf,ota_config_t *ota_config)
+// checks the hash of the received image against the manifest, see ota_check_manifest_digest
+static esp_err_t ota_check_digest(ota_download_t *dl, const ota_manifest_t *manifest, bool *checked)
 {
-    esp_err_t err;
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&dl->sha, digest);
+    return ota_check_manifest_digest(digest, manifest, checked);
+}
 
-    esp_http_client_config_t config = {
-        .url = (char *)url_buf,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-        .client_cert_pem = (char *)cert_buf,
-        .client_key_pem = (char *)key_buf,
-        .timeout_ms = OTA_RECV_TIMEOUT,
-        .keep_alive_enable = true,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
+#ifdef OTA_PROBE_INSTALLED
+// a partly written update partition starts with the same app description as the finished image,
+// so after a probe match the whole image in the partition is verified before the download is skipped
+// returns true if it is complete and, if the manifest has a sha256, the one the manifest describes
+static bool ota_installed_verified(ota_download_t *dl, const ota_manifest_t *manifest)
+{
+    const esp_partition_t *partition = dl->ota_config->update_partition;
+    esp_image_metadata_t image_metadata;
+    const esp_partition_pos_t part_pos = {
+        .offset = partition->address,
+        .size = partition->size,
     };
+    if (esp_image_verify(ESP_IMAGE_VERIFY, &part_pos, &image_metadata) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Image in the update partition is incomplete or corrupted");
+        return false;
+    }
+    size_t image_len = image_metadata.image_len;
+    if (manifest != NULL && manifest->image_size > 0 && manifest->image_size != image_len)
+    {
+        ESP_LOGW(TAG, "Image in the update partition is %u bytes, manifest says %u", (unsigned)image_len, (unsigned)manifest->image_size);
+        return false;
+    }
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    if (client == NULL)
+    // the sector buffer still holds the probed bytes the download continues with
+    uint8_t *buf = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+    if (buf == NULL)
     {
-        ESP_LOGE(TAG, "Failed to initialise HTTP connection");
+        ESP_LOGE(TAG, "Failed to allocate memory for the image check");
+        return false;
+    }
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    bool read_ok = true;
+    for (size_t offset = 0; read_ok && offset < image_len; offset += SPI_FLASH_SEC_SIZE)
+    {
+        size_t len = image_len - offset < SPI_FLASH_SEC_SIZE ? image_len - offset : SPI_FLASH_SEC_SIZE;
+        read_ok = esp_partition_read(partition, offset, buf, len) == ESP_OK;
+        if (read_ok)
+        {
+            mbedtls_sha256_update(&sha, buf, len);
+        }
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    free(buf);
+    if (!read_ok)
+    {
+        ESP_LOGW(TAG, "Failed to read the image in the update partition");
+        return false;
+    }
+    bool checked = false;
+    return ota_check_manifest_digest(digest, manifest, &checked) == ESP_OK;
+}
+#endif
+
+// copies the counters of the run to the metrics and takes the final times
+static void ota_metrics_finish(ota_download_t *dl, int64_t run_start_time)
+{
+    ota_metrics_t *metrics = dl->metrics;
+    metrics->layout = OTA_METRICS_LAYOUT;
+    metrics->download_total_us = esp_timer_get_time() - run_start_time;
+    metrics->bytes_received = dl->bytes_received;
+    metrics->bytes_written = dl->write_offset;
+    metrics->sectors_written = dl->sectors_written;
+    metrics->sectors_skipped = dl->sectors_skipped;
+    metrics->download_heap_peak = https_heap_peak();
+    if (metrics->download_heap_peak > OTA_HEAP_BUDGET)
+    {
+        ESP_LOGW(TAG, "OTA download used %u bytes of heap, more than OTA_HEAP_BUDGET (%u)", (unsigned)metrics->download_heap_peak, (unsigned)OTA_HEAP_BUDGET);
+    }
+    if (metrics->read_calls > 0)
+    {
+        metrics->read_avg_us = (uint32_t)(metrics->read_us / metrics->read_calls);
+    }
+    else
+    {
+        metrics->read_min_us = 0;
+    }
+}
+
+esp_err_t ota_update(const https_creds_t *creds,char* url_buf,const char *version_buf,const ota_manifest_t *manifest,bool use_delta,ota_config_t *ota_config,ota_metrics_t *metrics)
+{
+    esp_err_t err;
+    int64_t run_start_time = esp_timer_get_time();
+    const char *delta_url = use_delta && manifest != NULL && manifest->delta_url[0] != '\0' ? manifest->delta_url : NULL;
+
+    if (ota_config->update_partition == ota_config->running_partition)
+    {
+        ESP_LOGE(TAG, "Refusing to write the image over the running partition");
         task_fatal_error();
     }
-    err = esp_http_client_open(client, 0);
-    if (err != ESP_OK)
+
+    // a connection kept from the version check is already allocated, only a new one counts to the peak
+    https_heap_start();
+    if (heap_caps_get_free_size(MALLOC_CAP_8BIT) < OTA_HEAP_BUDGET)
     {
-        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
+        ESP_LOGW(TAG, "Only %u bytes of heap free for an OTA_HEAP_BUDGET of %u bytes",
+                 (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT), (unsigned)OTA_HEAP_BUDGET);
+    }
+    ota_download_t *dl = (ota_download_t *)calloc(1, sizeof(ota_download_t));
+    if (dl == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for the ota download");
         task_fatal_error();
     }
-    esp_http_client_fetch_headers(client);
-    int binary_file_length = 0;
+    dl->ota_config = ota_config;
+    dl->chunk_size = ota_chunk_size_valid(ota_config->chunk_size) ? ota_config->chunk_size : OTA_CHUNK_SIZE;
+    dl->metrics = metrics != NULL ? metrics : &dl->own_metrics;
+    // the version check fills its own fields before
+    dl->metrics->dns_us = 0;
+    dl->metrics->connect_us = 0;
+    dl->metrics->ttfb_us = 0;
+    dl->metrics->read_us = 0;
+    dl->metrics->flash_us = 0;
+    dl->metrics->verify_us = 0;
+    dl->metrics->requests = 0;
+    dl->metrics->attempts = 0;
+    dl->metrics->read_calls = 0;
+    dl->metrics->read_min_us = UINT32_MAX;
+    dl->metrics->read_max_us = 0;
+    dl->metrics->read_avg_us = 0;
+    dl->metrics->stalls = 0;
+    dl->metrics->result = ESP_OK;
+    dl->sector = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+#ifdef OTA_SKIP_UNCHANGED_SECTORS
+    dl->compare_buf = (uint8_t *)malloc(OTA_SKIP_COMPARE_SIZE);
+    if (dl->compare_buf == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for the ota download");
+        task_fatal_error();
+    }
+#endif
+    if (dl->sector == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for the ota download");
+        task_fatal_error();
+    }
+    mbedtls_sha256_init(&dl->sha);
+    mbedtls_sha256_starts(&dl->sha, 0);
+    strlcpy(dl->progress.url, url_buf, sizeof(dl->progress.url));
+    strlcpy(dl->progress.version, version_buf, sizeof(dl->progress.version));
+
+    // continue an interrupted download of the same image if the flash still holds what was written
+    ota_progress_t saved;
+    if (get_ota_progress_nvs(&saved) == 0)
+    {
+        if (strcmp(saved.url, url_buf) == 0 && strcmp(saved.version, version_buf) == 0 && ota_restore_checkpoint(dl, &saved))
+        {
+            ESP_LOGI(TAG, "Found ota checkpoint, %u of %u bytes already written", (unsigned)saved.bytes_written, (unsigned)saved.total_length);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Discarding ota checkpoint of another image");
+            clear_ota_progress_nvs();
+        }
+    }
 
-    bool image_header_was_checked = false;
+    int64_t start_time = esp_timer_get_time();
+    esp_http_client_handle_t client = ota_client_init(dl, creds, url_buf);
+    ota_resolve_host(dl, url_buf);
 
-    while (1)
+#if OTA_USE_PIPELINE
+    const char *mode = "pipelined";
+#else
+    const char *mode = "serial";
+#endif
+    int64_t download_time_us = 0;
+    const char *payload = "image";
+    bool body_open = false;
+
+    if (manifest != NULL && ota_encoding_is_zlib(manifest->compression))
     {
-        // reads the data from the server and writes to the ota partition in chunks of size BUFFSIZE
-        int data_read = esp_http_client_read(client, ota_write_data, OTA_BUFFSIZE);
-        if (data_read < 0)
+        dl->inflate = ota_decompressor_create(dl);
+        if (dl->inflate == NULL)
         {
-            ESP_LOGE(TAG, "Error: SSL data read error");
             http_cleanup(client);
             task_fatal_error();
         }
-        else if (data_read > 0)
+    }
+
+#ifdef OTA_PROBE_INSTALLED
+    // after a restart between ota_update and ota_end the update partition already holds the new image
+    if (dl->write_offset == 0)
+    {
+        if (ota_probe_installed(dl, &body_open))
         {
-            if (image_header_was_checked == false)
+            int64_t check_start_time = esp_timer_get_time();
+            if (ota_installed_verified(dl, manifest))
             {
-                // will check the header of the image to compare versions and also call the esp_ota_begin function but only in the first iteration
-                esp_app_desc_t new_app_info;
-                if (data_read > sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
-                {
-                    // check current version with downloading
-                    memcpy(&new_app_info, &ota_write_data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
-
-                    image_header_was_checked = true;
-
-                    err = esp_ota_begin(ota_config->update_partition, OTA_WITH_SEQUENTIAL_WRITES, &ota_config->update_handle);
-                    if (err != ESP_OK)
-                    {
-                        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-                        http_cleanup(client);
-                        esp_ota_abort(ota_config->update_handle);
-                        task_fatal_error();
-                    }
-                    ESP_LOGI(TAG, "esp_ota_begin succeeded");
-                }
-                else
-                {
-                    ESP_LOGE(TAG, "first received package is not fit len (too small)");
-                    http_cleanup(client);
-                    esp_ota_abort(ota_config->update_handle);
-                    task_fatal_error();
-                }
+                ESP_LOGI(TAG, "Update partition already holds the server image (verified in %lld ms) -> skipping the download",
+                         (esp_timer_get_time() - check_start_time) / 1000);
+                goto cleanup;
             }
-            err = esp_ota_write(ota_config->update_handle, (const void *)ota_write_data, data_read);
-            if (err != ESP_OK)
+            // the probe closed the connection, so the download starts over from the first byte
+            ESP_LOGW(TAG, "Update partition holds the server build but not the whole image -> downloading it again");
+            body_open = false;
+            ota_download_restart(dl);
+        }
+        if (delta_url != NULL)
+        {
+            // the patch is tried first, so the probed bytes are not needed
+            if (body_open)
             {
-                http_cleanup(client);
-                esp_ota_abort(ota_config->update_handle);
-                task_fatal_error();
+                esp_http_client_close(client);
+                body_open = false;
             }
-            binary_file_length += data_read;
-            ESP_LOGD(TAG, "Written image length %d", binary_file_length);
+            ota_download_restart(dl);
         }
-        else if (data_read == 0)
+    }
+#endif
+
+    // a patch can only be applied to an intact installed image
+    if (delta_url != NULL && dl->write_offset == 0)
+    {
+        int64_t download_start_time = esp_timer_get_time();
+        err = ota_apply_delta(dl, delta_url, ota_encoding_is_zlib(manifest->delta_compression));
+        download_time_us += esp_timer_get_time() - download_start_time;
+        if (err == ESP_OK)
         {
-            /*
-             * As esp_http_client_read never returns negative error code, we rely on
-             * `errno` to check for underlying transport connectivity closure if any
-             */
-            if (errno == ECONNRESET || errno == ENOTCONN)
+            payload = "patch";
+            goto verify;
+        }
+        // the sectors written from a patch hold the new image, so the full download continues after them
+        ESP_LOGW(TAG, "Delta update failed (%s) -> downloading the full image from byte %u", esp_err_to_name(err), (unsigned)dl->write_offset);
+        esp_http_client_set_url(client, url_buf);
+    }
+
+    if (dl->inflate != NULL && dl->write_offset > 0 && dl->stream_offset == 0)
+    {
+        // offsets in the compressed stream do not map to image offsets, only the stream itself can be resumed
+        ESP_LOGW(TAG, "Compressed image can not continue after byte %u -> downloading it from the start", (unsigned)dl->write_offset);
+        ota_download_restart(dl);
+    }
+
+    // no patch and no probe need the installed image anymore, so erasing can start before the connection is open
+    ota_erase_ahead_start(dl, ota_image_size_hint(dl, manifest));
+
+    int attempt = 0;
+    while (1)
+    {
+        // the probe may have left the response to a whole image request open
+        err = body_open ? ESP_OK : ota_open_connection(dl);
+        body_open = false;
+        if (err == ESP_OK)
+        {
+            // the length is known now if the manifest did not have it
+            ota_erase_ahead_start(dl, ota_image_size_hint(dl, manifest));
+            int64_t download_start_time = esp_timer_get_time();
+            err = ota_download(dl);
+            download_time_us += esp_timer_get_time() - download_start_time;
+            if (err != ESP_OK)
             {
-                ESP_LOGE(TAG, "Connection closed, errno = %d", errno);
-                break;
+                // flash problems (or a corrupted compressed image) will not go away by downloading again
+                ESP_LOGE(TAG, "Failed to write the image to the update partition (%s)", esp_err_to_name(err));
+                clear_ota_progress_nvs();
+                http_cleanup(client);
+                task_fatal_error();
             }
-            if (esp_http_client_is_complete_data_received(client) == true)
+            if (!dl->read_failed && esp_http_client_is_complete_data_received(client) == true)
             {
-                ESP_LOGI(TAG, "Connection closed");
                 break;
             }
+            ESP_LOGE(TAG, "Error in receiving complete file");
+        }
+        else if (err == ESP_ERR_INVALID_VERSION)
+        {
+            ota_download_restart(dl);
+        }
+        esp_http_client_close(client);
+
+        // keep what we have so the next attempt (or the next run after a restart) does not start from zero
+        ota_checkpoint(dl, true);
+        dl->metrics->attempts++;
+        if (++attempt > OTA_MAX_RESUME_ATTEMPTS)
+        {
+            ESP_LOGE(TAG, "Giving up after %d attempts, next run will resume at byte %u", attempt, (unsigned)dl->last_checkpoint);
+            // the caller never sees this run, so its metrics are stored here
+            ota_metrics_finish(dl, run_start_time);
+            dl->metrics->result = ESP_FAIL;
+            ota_log_metrics(dl->metrics);
+            set_ota_metrics_nvs(dl->metrics);
+            https_conn_release(client);
+            task_fatal_error();
+        }
+        ESP_LOGW(TAG, "Retrying ota download at byte %u (attempt %d of %d)", (unsigned)dl->write_offset, attempt, OTA_MAX_RESUME_ATTEMPTS);
+        vTaskDelay(pdMS_TO_TICKS(OTA_RESUME_RETRY_DELAY_MS));
+    }
+    dl->payload_compressed = dl->inflate != NULL;
+    if (dl->inflate != NULL)
+    {
+        err = ota_inflate_finish(dl->inflate);
+        if (err != ESP_OK)
+        {
+            clear_ota_progress_nvs();
+            http_cleanup(client);
+            task_fatal_error();
         }
     }
-    ESP_LOGI(TAG, "Total Write binary data length: %d", binary_file_length);
-    if (esp_http_client_is_complete_data_received(client) != true)
+
+verify:
+    err = ota_write_flush(dl);
+    if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Error in receiving complete file");
+        clear_ota_progress_nvs();
         http_cleanup(client);
-        esp_ota_abort(ota_config->update_handle);
         task_fatal_error();
     }
+    ota_erase_ahead_stop(dl);
+    // throughput counter -> compare the log of both modes to see the gain of the pipeline,
+    // of a raw and a compressed image to see the gain of compression
+    // with a delta update the bytes received are the patch bytes, much less than the image length
+    ESP_LOGI(TAG, "Total Write binary data length: %d", (int)dl->write_offset);
+    ESP_LOGI(TAG, "OTA download (%s, %s %s): %d bytes on the wire for %d image bytes (%d%%) in %lld ms (%lld ms including connect) -> %lld KB/s",
+             mode, dl->payload_compressed ? "zlib" : "raw", payload,
+             (int)dl->bytes_received, (int)dl->write_offset, dl->write_offset > 0 ? (int)((int64_t)dl->bytes_received * 100 / dl->write_offset) : 0,
+             download_time_us / 1000, (esp_timer_get_time() - start_time) / 1000,
+             download_time_us > 0 ? ((int64_t)dl->bytes_received * 1000000 / download_time_us) / 1024 : 0);
+    ESP_LOGI(TAG, "Flash sectors: %u written, %u skipped (unchanged)", dl->sectors_written, dl->sectors_skipped);
 
-    err = esp_ota_end(ota_config->update_handle);
+    // the image was hashed while it arrived, so a bad one is rejected without reading the partition again
+    bool digest_checked = false;
+    int64_t check_start_time = esp_timer_get_time();
+    err = ota_check_digest(dl, manifest, &digest_checked);
     if (err != ESP_OK)
     {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED)
+        ESP_LOGE(TAG, "Image rejected, it is not the one the manifest describes");
+        clear_ota_progress_nvs();
+        http_cleanup(client);
+        task_fatal_error();
+    }
+    if (digest_checked)
+    {
+        ESP_LOGI(TAG, "Streamed image digest checked in %lld ms", (esp_timer_get_time() - check_start_time) / 1000);
+    }
+
+    bool read_back = !digest_checked;
+#ifdef OTA_BENCHMARK_VERIFY
+    read_back = true;
+#endif
+    if (read_back)
+    {
+        // same check esp_ota_end does
+        int64_t verify_start_time = esp_timer_get_time();
+        esp_image_metadata_t image_metadata;
+        const esp_partition_pos_t part_pos = {
+            .offset = ota_config->update_partition->address,
+            .size = ota_config->update_partition->size,
+        };
+        err = esp_image_verify(ESP_IMAGE_VERIFY, &part_pos, &image_metadata);
+        if (err != ESP_OK)
         {
             ESP_LOGE(TAG, "Image validation failed, image is corrupted");
+            clear_ota_progress_nvs();
+            http_cleanup(client);
+            task_fatal_error();
         }
-        else
+        ESP_LOGI(TAG, "Image read back and verified in %lld ms", (esp_timer_get_time() - verify_start_time) / 1000);
+    }
+    dl->metrics->verify_us = esp_timer_get_time() - check_start_time;
+    clear_ota_progress_nvs();
+#ifdef OTA_PROBE_INSTALLED
+cleanup:
+#endif
+    ota_metrics_finish(dl, run_start_time);
+    // the connection stays open until app_main closes all of them
+    https_conn_release(client);
+    ota_decompressor_destroy(dl->inflate);
+    mbedtls_sha256_free(&dl->sha);
+    free(dl->sector);
+    free(dl->compare_buf);
+    free(dl);
+    return ESP_OK;
+}
+
+
+#if defined(OTA_CHUNK_SWEEP) || defined(OTA_CIPHER_SWEEP)
+// one download of a sweep
+typedef struct ota_sweep_result_t
+{
+    size_t bytes;
+    int64_t time_us;
+    size_t heap_peak;
+    int cpu_load; // percent of all cores, -1 without the FreeRTOS run time stats
+    bool complete;
+    bool programmed; // the received sectors were programmed to flash as well
+} ota_sweep_result_t;
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_USE_TRACE_FACILITY
+// run time of the idle tasks of all cores and the total run time (of one core)
+static bool ota_idle_time(uint64_t *idle, uint64_t *total)
+{
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    TaskStatus_t *tasks = (TaskStatus_t *)malloc(count * sizeof(TaskStatus_t));
+    if (tasks == NULL)
+    {
+        return false;
+    }
+    configRUN_TIME_COUNTER_TYPE total_time = 0;
+    count = uxTaskGetSystemState(tasks, count, &total_time);
+    *idle = 0;
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        if (strncmp(tasks[i].pcTaskName, "IDLE", 4) == 0)
         {
-            ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
+            *idle += tasks[i].ulRunTimeCounter;
+        }
+    }
+    *total = total_time;
+    free(tasks);
+    return true;
+}
+#endif
+
+// connects, reads and hashes url_buf like a real download, the kept connection is closed first so every run pays the same handshake
+// if program is true the received sectors are programmed to the scratch sectors of the update partition (if there are any),
+// otherwise nothing is written
+static esp_err_t ota_sweep_download(const https_creds_t *creds, char *url_buf, ota_config_t *ota_config, size_t chunk_size, bool program, ota_sweep_result_t *result)
+{
+    ota_download_t *dl = (ota_download_t *)calloc(1, sizeof(ota_download_t));
+    if (dl == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    dl->ota_config = ota_config;
+    dl->chunk_size = chunk_size;
+    dl->sweep = true;
+    dl->metrics = &dl->own_metrics;
+#ifdef OTA_CHUNK_SWEEP
+    if (program)
+    {
+        dl->sweep_scratch_start = ota_sweep_scratch_start(ota_config->update_partition);
+        dl->sweep_scratch_offset = dl->sweep_scratch_start;
+        dl->sweep_program = dl->sweep_scratch_start < ota_config->update_partition->size;
+        if (dl->sweep_program)
+        {
+            dl->sector = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+            if (dl->sector == NULL)
+            {
+                free(dl);
+                return ESP_ERR_NO_MEM;
+            }
         }
-        http_cleanup(client);
-        task_fatal_error();
     }
+#endif
+    https_heap_start();
+    mbedtls_sha256_init(&dl->sha);
+    mbedtls_sha256_starts(&dl->sha, 0);
+
+    esp_http_client_handle_t client = ota_client_init(dl, creds, url_buf);
+    esp_http_client_close(client);
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_USE_TRACE_FACILITY
+    uint64_t idle_start = 0, total_start = 0;
+    bool have_load = ota_idle_time(&idle_start, &total_start);
+#endif
+    int64_t start_time = esp_timer_get_time();
+    esp_err_t err = ota_open_connection(dl);
+    if (err == ESP_OK)
+    {
+        err = ota_download(dl);
+    }
+    result->time_us = esp_timer_get_time() - start_time;
+    result->cpu_load = -1;
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_USE_TRACE_FACILITY
+    uint64_t idle_end = 0, total_end = 0;
+    if (have_load && ota_idle_time(&idle_end, &total_end) && total_end > total_start)
+    {
+        uint64_t capacity = (total_end - total_start) * portNUM_PROCESSORS;
+        uint64_t idle = idle_end - idle_start;
+        result->cpu_load = idle < capacity ? (int)(100 - idle * 100 / capacity) : 0;
+    }
+#endif
+    result->bytes = dl->bytes_received;
+    result->heap_peak = https_heap_peak();
+    result->complete = err == ESP_OK && !dl->read_failed && esp_http_client_is_complete_data_received(client) == true;
+    result->programmed = dl->sweep_program;
+
+    http_cleanup(client);
+    ota_decompressor_destroy(dl->inflate);
+    mbedtls_sha256_free(&dl->sha);
+    free(dl->sector);
+    free(dl);
     return ESP_OK;
-    
+}
+#endif
 
+#ifdef OTA_CHUNK_SWEEP
+static const size_t ota_sweep_chunk_sizes[] = { 1024, 4096, 8192, 16384 };
+
+void ota_chunk_sweep(const https_creds_t *creds,char* url_buf,ota_config_t *ota_config)
+{
+    size_t best_chunk_size = 0;
+    int64_t best_rate = 0;
+    bool programmed = true;
+    for (int i = 0; i < sizeof(ota_sweep_chunk_sizes) / sizeof(ota_sweep_chunk_sizes[0]); i++)
+    {
+        ota_sweep_result_t result;
+        if (ota_sweep_download(creds, url_buf, ota_config, ota_sweep_chunk_sizes[i], true, &result) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to allocate memory for the chunk size sweep");
+            return;
+        }
+        int64_t rate = result.time_us > 0 ? ((int64_t)result.bytes * 1000000 / result.time_us) / 1024 : 0;
+        ESP_LOGI(TAG, "Chunk size sweep %5u bytes: %d bytes in %lld ms -> %lld KB/s, peak heap use %u bytes%s%s",
+                 (unsigned)ota_sweep_chunk_sizes[i], (int)result.bytes, result.time_us / 1000, rate,
+                 (unsigned)result.heap_peak, result.complete ? "" : " (incomplete)", result.programmed ? "" : " (network only)");
+        programmed = programmed && result.programmed;
+        if (result.complete && rate > best_rate)
+        {
+            best_rate = rate;
+            best_chunk_size = ota_sweep_chunk_sizes[i];
+        }
+    }
+    if (best_chunk_size == 0)
+    {
+        ESP_LOGW(TAG, "Chunk size sweep failed, keeping %u bytes", (unsigned)ota_config->chunk_size);
+        return;
+    }
+    if (!programmed)
+    {
+        // the network alone favours other sizes than network and flash together
+        ESP_LOGW(TAG, "Fastest chunk size %u bytes (%lld KB/s) without flash writes (too few scratch sectors behind the installed image) -> not stored",
+                 (unsigned)best_chunk_size, best_rate);
+        return;
+    }
+    ESP_LOGI(TAG, "Fastest chunk size %u bytes (%lld KB/s) -> stored in NVS", (unsigned)best_chunk_size, best_rate);
+    ota_config->chunk_size = best_chunk_size;
+    if (set_ota_chunk_size_nvs(best_chunk_size) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store the ota chunk size in NVS");
+    }
+}
+#endif
+
+#ifdef OTA_CIPHER_SWEEP
+// each candidate is offered with both key exchanges, so it works with an RSA and an ECDSA server certificate
+typedef struct ota_sweep_cipher_t
+{
+    const char *name;
+    int ciphersuites[3];
+} ota_sweep_cipher_t;
+
+static const ota_sweep_cipher_t ota_sweep_ciphers[] = {
+    {"AES-128-GCM", {MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256, MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256, 0}},
+    {"AES-256-GCM", {MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384, MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384, 0}},
+    {"AES-128-CBC-SHA256", {MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256, MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256, 0}},
+    {"AES-256-CBC-SHA384", {MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA384, MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_CBC_SHA384, 0}},
+#ifdef MBEDTLS_CHACHAPOLY_C
+    {"CHACHA20-POLY1305", {MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256, MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256, 0}},
+#endif
+};
+
+void ota_cipher_sweep(const https_creds_t *creds,char* url_buf,ota_config_t *ota_config)
+{
+    size_t chunk_size = ota_chunk_size_valid(ota_config->chunk_size) ? ota_config->chunk_size : OTA_CHUNK_SIZE;
+    for (int i = 0; i < sizeof(ota_sweep_ciphers) / sizeof(ota_sweep_ciphers[0]); i++)
+    {
+        https_set_ciphersuites(ota_sweep_ciphers[i].ciphersuites);
+        ota_sweep_result_t result;
+        if (ota_sweep_download(creds, url_buf, ota_config, chunk_size, false, &result) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to allocate memory for the cipher sweep");
+            break;
+        }
+        if (result.bytes == 0)
+        {
+            ESP_LOGI(TAG, "Cipher sweep %-18s: not accepted by the server", ota_sweep_ciphers[i].name);
+            continue;
+        }
+        int64_t rate = result.time_us > 0 ? (int64_t)result.bytes * 1000000 / result.time_us : 0;
+        ESP_LOGI(TAG, "Cipher sweep %-18s: %d bytes in %lld ms -> %lld.%02lld MB/s, cpu load %d%%%s",
+                 ota_sweep_ciphers[i].name, (int)result.bytes, result.time_us / 1000,
+                 rate / (1024 * 1024), (rate % (1024 * 1024)) * 100 / (1024 * 1024), result.cpu_load,
+                 result.complete ? "" : " (incomplete)");
+    }
+    https_set_ciphersuites(NULL);
+    // the kept connection negotiated the last candidate, the download reconnects with HTTPS_CIPHERSUITES
+    esp_http_client_handle_t client = https_conn_get(url_buf, creds);
+    if (client != NULL)
+    {
+        esp_http_client_close(client);
+        https_conn_release(client);
+    }
 }
+#endif
 
+void ota_log_metrics(const ota_metrics_t *metrics)
+{
+    ESP_LOGI(TAG, "OTA metrics (result %s):", esp_err_to_name(metrics->result));
+    ESP_LOGI(TAG, "  wifi: associated in %lld us (%s)", metrics->wifi_assoc_us,
+             metrics->wifi_ap_cache == 1 ? "cached AP" : metrics->wifi_ap_cache == 2 ? "cached AP failed, full scan" : "full scan");
+    ESP_LOGI(TAG, "  wifi: got IP in %lld us (%s)", metrics->wifi_ip_us,
+             metrics->wifi_ip_method == 2 ? "static lease" : metrics->wifi_ip_method == 1 ? "DHCP with the cached address" : "DHCP");
+    ESP_LOGI(TAG, "  version check: status %d, %lld us connect, %lld us ttfb, %lld us total, peak heap use %u bytes",
+             (int)metrics->version_status, metrics->version_connect_us, metrics->version_ttfb_us, metrics->version_total_us,
+             (unsigned)metrics->version_heap_peak);
+    ESP_LOGI(TAG, "  download: %lld us dns, %lld us connect, %lld us ttfb, %lld us read, %lld us flash, %lld us verify, %lld us total",
+             metrics->dns_us, metrics->connect_us, metrics->ttfb_us, metrics->read_us, metrics->flash_us, metrics->verify_us, metrics->download_total_us);
+#ifdef HTTPS_LOW_MEMORY
+    const char *profile = "low memory";
+#else
+    const char *profile = "default";
+#endif
+    ESP_LOGI(TAG, "  download peak heap use %u of %u bytes budget (%s profile)",
+             (unsigned)metrics->download_heap_peak, (unsigned)OTA_HEAP_BUDGET, profile);
+    ESP_LOGI(TAG, "  %u bytes received, %u bytes written, %u requests, %u broken attempts, %u sectors written, %u skipped",
+             (unsigned)metrics->bytes_received, (unsigned)metrics->bytes_written, (unsigned)metrics->requests, (unsigned)metrics->attempts,
+             (unsigned)metrics->sectors_written, (unsigned)metrics->sectors_skipped);
+    ESP_LOGI(TAG, "  %u reads: %u/%u/%u us min/avg/max, %u stalls over %d ms",
+             (unsigned)metrics->read_calls, (unsigned)metrics->read_min_us, (unsigned)metrics->read_avg_us, (unsigned)metrics->read_max_us,
+             (unsigned)metrics->stalls, OTA_STALL_THRESHOLD_US / 1000);
+    ESP_LOGI(TAG, "  %u TLS handshakes with %s device key in %lld us, %u offered a saved session",
+             (unsigned)metrics->tls_handshakes, metrics->key_type == MBEDTLS_PK_ECKEY ? "an ECDSA" : metrics->key_type == MBEDTLS_PK_RSA ? "an RSA" : "an unknown",
+             metrics->tls_handshake_us, (unsigned)metrics->tls_sessions_offered);
+    ESP_LOGI(TAG, "  server chains: %u accepted by envdata/tlstrust, %u by the certificate bundle, %lld us verifying",
+             (unsigned)metrics->tls_pinned, (unsigned)metrics->tls_bundle, metrics->tls_verify_us);
+    ESP_LOGI(TAG, "  boot partition set in %lld us", metrics->boot_set_us);
+}
 
 esp_err_t ota_end(ota_config_t *ota_config){
     esp_err_t err;
@@ -172,5 +1933,3 @@ esp_err_t ota_end(ota_config_t *ota_config){
     }
     return err;
 }
-
-
@@ -9,22 +9,126 @@
 #include "helpers.h"
 #include "esp_http_client.h"
 #include "esp_crt_bundle.h"
+#include "esp_timer.h"
+#include "freertos/event_groups.h"
+#include "spi_flash_mmap.h"
+#include "ota_ring.h"
+#include "ota_delta.h"
+#include "ota_inflate.h"
+#include "https.h"
+#include "nvs.h"
+#include "esp_image_format.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/base64.h"
+#include "esp_heap_caps.h"
+#include <strings.h>
 
 #include "esp_log.h"
+#include "sdkconfig.h"
 #include "errno.h"
 #include "esp_system.h"
 #include "esp_event.h"
 
 
 
-#define OTA_BUFFSIZE 1024
+/**** CONFIGURATION ****/
+
 #define OTA_RECV_TIMEOUT 3000
+
+// size of each network read (and ring buffer), a power of two between OTA_CHUNK_MIN_SIZE and OTA_CHUNK_MAX_SIZE
+// whole flash sectors go to flash without being copied, one read returns up to a TLS record (CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN)
+// can be changed at runtime with the ota_chunk key in NVS (see ota_chunk_sweep)
+#define OTA_CHUNK_SIZE SPI_FLASH_SEC_SIZE
+#define OTA_CHUNK_MIN_SIZE 1024
+#define OTA_CHUNK_MAX_SIZE 16384
+// uncomment to download the image once per chunk size (1/4/8/16 KB) before each update, the received sectors are programmed
+// to the scratch sectors behind the installed image so network and flash are timed together,
+// the log shows the throughput and peak heap use of each size and the fastest one is stored in NVS
+// wear limit: each size programs at most one pass over the scratch sectors (every scratch sector is erased at most once
+// per size, 4 times per sweep), and with fewer than OTA_SWEEP_MIN_SCRATCH_SECTORS of them nothing is programmed,
+// the network only result is then just logged
+// #define OTA_CHUNK_SWEEP
+#define OTA_SWEEP_MIN_SCRATCH_SECTORS 16
+// uncomment to download the image once per candidate ciphersuite (AES-GCM, AES-CBC, ChaCha20 if built in) before each update,
+// the log shows the throughput and cpu load of each (the cpu load needs CONFIG_FREERTOS_USE_TRACE_FACILITY and
+// CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS), the order to offer goes to HTTPS_CIPHERSUITES in https.h
+// #define OTA_CIPHER_SWEEP
+
+// comment out to use the old serial read->write loop (always used on CONFIG_FREERTOS_UNICORE builds)
+// when enabled one task reads from the network while another one writes the previous chunks to flash
+#define OTA_PIPELINED
+
+// core where the wifi/lwip tasks run, the network reader task is pinned to it
+#define OTA_NET_CORE 0
+// the flash writer task is pinned to the other core
+#define OTA_FLASH_CORE 1
+#define OTA_TASK_STACK_SIZE 4096
+#define OTA_TASK_PRIORITY 5
+
+// the download progress is stored in NVS every this many bytes so an interrupted download can be resumed
+#define OTA_CHECKPOINT_INTERVAL (64 * 1024)
+// how many times a broken download is resumed (with an HTTP Range request) before restarting the esp32
+#define OTA_MAX_RESUME_ATTEMPTS 5
+#define OTA_RESUME_RETRY_DELAY_MS 2000
+
+// comment out to erase and program every sector of the image
+// when enabled a sector that already holds the new bytes (same image, or unchanged parts of it) is neither erased nor programmed
+#define OTA_SKIP_UNCHANGED_SECTORS
+// the existing sector is read back and compared in pieces of this size
+#define OTA_SKIP_COMPARE_SIZE 1024
+
+// comment out to always download the image
+// when enabled the start of the image is fetched first and nothing else is downloaded if the update partition already holds that build
+#define OTA_PROBE_INSTALLED
+
+// comment out to erase each sector only when its data arrived
+// when enabled a background task erases the update partition up to the expected image length (manifest "size" or the
+// server reported length) while the connection is opened, the writer then programs those sectors without erasing them
+// with OTA_SKIP_UNCHANGED_SECTORS only the sectors behind the installed image are erased ahead, the ones it covers are still compared
+#define OTA_ERASE_AHEAD
+// erases of this size are used once the erase reaches a block boundary
+#define OTA_ERASE_BLOCK_SIZE (64 * 1024)
+#define OTA_ERASE_TASK_STACK_SIZE 2048
+
+// uncomment to also read the whole image back with esp_image_verify after the streamed digest was checked,
+// the log then shows the time of both checks
+// #define OTA_BENCHMARK_VERIFY
+
+// a network read that takes longer than this counts as a stall in the ota metrics
+#define OTA_STALL_THRESHOLD_US (500 * 1000)
+
+// heap the download may use at most (buffers, tasks, decompressor and its TLS connection), checked against the measured peak
+// the low memory one assumes sdkconfig.lowmem and an image that is not compressed
+#ifdef HTTPS_LOW_MEMORY
+#define OTA_HEAP_BUDGET (48 * 1024)
+#else
+#define OTA_HEAP_BUDGET (128 * 1024)
+#endif
+
+/****               ****/
+
+// the probe reads the image up to the end of its esp_app_desc_t
+#define OTA_PROBE_SIZE (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t))
+
+// the pipeline needs the ring and two more task stacks, the low memory profile does without
+#if defined(OTA_PIPELINED) && !CONFIG_FREERTOS_UNICORE && !defined(HTTPS_LOW_MEMORY)
+#define OTA_USE_PIPELINE 1
+#else
+#define OTA_USE_PIPELINE 0
+#endif
+
+// public key (PEM) that signs the images, images are only accepted with a valid signature
+// as long as it is the placeholder only the sha256 of the manifest is checked
+extern const uint8_t otasignkey_start[] asm("_binary_otasignkey_start");
+extern const uint8_t otasignkey_end[] asm("_binary_otasignkey_end");
+
 //struct that holds ota config parameters
 typedef struct ota_config_t
 {
-    esp_ota_handle_t update_handle;
     const esp_partition_t *update_partition;
     const esp_partition_t *running_partition;
+    size_t chunk_size; // bytes per network read, OTA_CHUNK_SIZE unless NVS says otherwise
 } ota_config_t;
 
 
@@ -38,8 +142,33 @@ esp_err_t ota_end(ota_config_t *ota_config);
 
 
 // Function to download and update the firmware
-// needs a allocated cert_buf,key_buf and url_buf and ota_config_t struct initialized
-esp_err_t ota_update(char* cert_buf,char* key_buf,char* url_buf,ota_config_t *ota_config);
+// needs loaded creds, an allocated url_buf and version_buf and ota_config_t struct initialized
+// if a previous download of the same url and version was interrupted it continues from the last checkpoint
+// if use_delta is true it first tries to apply the patch at manifest->delta_url to the installed image (see ota_delta.h)
+// and falls back to downloading url_buf if the patch does not fit or fails
+// the image and the patch are decompressed on the fly if the manifest or the Content-Encoding says so (see ota_inflate.h)
+// returns ESP_OK without downloading anything if the update partition already holds the complete and verified server image
+// the image is hashed while it arrives and checked against the sha256 and signature of the manifest
+// fills the download timings and counters of metrics (can be NULL), the version_* ones are left as they are
+esp_err_t ota_update(const https_creds_t *creds,char* url_buf,const char *version_buf,const ota_manifest_t *manifest,bool use_delta,ota_config_t *ota_config,ota_metrics_t *metrics);
+
+// logs the metrics of an update run in one block
+void ota_log_metrics(const ota_metrics_t *metrics);
+
+// returns true if NVS holds a checkpoint of an interrupted download of this version
+bool ota_resume_pending(const char *version_buf);
+
+#ifdef OTA_CHUNK_SWEEP
+// downloads url_buf once per chunk size, programs it to the scratch sectors behind the installed image
+// and logs the throughput and peak heap use of each
+// the fastest size is stored in NVS and set in ota_config, unless there were too few scratch sectors to program
+void ota_chunk_sweep(const https_creds_t *creds,char* url_buf,ota_config_t *ota_config);
+#endif
+
+#ifdef OTA_CIPHER_SWEEP
+// downloads url_buf once per candidate ciphersuite without writing it and logs the throughput and cpu load of each
+void ota_cipher_sweep(const https_creds_t *creds,char* url_buf,ota_config_t *ota_config);
+#endif
 
 
 
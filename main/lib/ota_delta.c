@@ -0,0 +1,264 @@
+#include "ota_delta.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+
+static uint32_t read_u32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+esp_err_t ota_delta_init(ota_delta_t *delta, const esp_partition_t *base_partition,
+                         ota_delta_write_cb_t write_cb, void *write_ctx)
+{
+    memset(delta, 0, sizeof(ota_delta_t));
+    delta->base_partition = base_partition;
+    delta->write_cb = write_cb;
+    delta->write_ctx = write_ctx;
+    delta->sector = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+    if (delta->sector == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for the patch output sector");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ota_delta_parse_header(ota_delta_t *delta)
+{
+    const uint8_t *header = delta->header;
+    if (memcmp(header, OTA_DELTA_MAGIC, 4) != 0)
+    {
+        ESP_LOGE(TAG, "Patch has an invalid magic");
+        return ESP_ERR_INVALID_VERSION;
+    }
+    delta->base_size = read_u32_le(header + 4);
+    memcpy(delta->base_sha256, header + 8, sizeof(delta->base_sha256));
+    delta->target_size = read_u32_le(header + 40);
+    if (delta->base_size == 0 || delta->base_size > delta->base_partition->size ||
+        delta->target_size == 0 || delta->target_size > delta->base_partition->size)
+    {
+        ESP_LOGE(TAG, "Patch sizes do not fit in the partition (base %u, target %u)", (unsigned)delta->base_size, (unsigned)delta->target_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ota_delta_check_base(ota_delta_t *delta)
+{
+    // the output sector is not used yet, so it doubles as read buffer
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    esp_err_t err = ESP_OK;
+    for (uint32_t offset = 0; offset < delta->base_size; offset += SPI_FLASH_SEC_SIZE)
+    {
+        size_t len = delta->base_size - offset < SPI_FLASH_SEC_SIZE ? delta->base_size - offset : SPI_FLASH_SEC_SIZE;
+        err = esp_partition_read(delta->base_partition, offset, delta->sector, len);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to read the installed image (%s)", esp_err_to_name(err));
+            break;
+        }
+        mbedtls_sha256_update(&sha, delta->sector, len);
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    if (err == ESP_OK && memcmp(digest, delta->base_sha256, sizeof(digest)) != 0)
+    {
+        ESP_LOGW(TAG, "Installed image is not the base of the patch");
+        err = ESP_ERR_INVALID_CRC;
+    }
+    return err;
+}
+
+// hands the sector to write_cb once it is full
+static esp_err_t ota_delta_flush_if_full(ota_delta_t *delta)
+{
+    if (delta->sector_len < SPI_FLASH_SEC_SIZE)
+    {
+        return ESP_OK;
+    }
+    esp_err_t err = delta->write_cb(delta->write_ctx, (const char *)delta->sector, delta->sector_len);
+    delta->sector_len = 0;
+    return err;
+}
+
+static esp_err_t ota_delta_copy(ota_delta_t *delta, uint32_t src, uint32_t len)
+{
+    if (len > delta->target_size - delta->produced || src > delta->base_size || len > delta->base_size - src)
+    {
+        ESP_LOGE(TAG, "Patch COPY out of bounds (src %u, len %u)", (unsigned)src, (unsigned)len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    while (len > 0)
+    {
+        // sectors before this one were already erased and hold the new image
+        uint32_t flushed_end = delta->produced - delta->sector_len;
+        if (src < flushed_end)
+        {
+            ESP_LOGE(TAG, "Patch COPY reads base data that was already overwritten (src %u, flushed %u)", (unsigned)src, (unsigned)flushed_end);
+            return ESP_ERR_INVALID_STATE;
+        }
+        size_t n = SPI_FLASH_SEC_SIZE - delta->sector_len;
+        if (n > len)
+        {
+            n = len;
+        }
+        esp_err_t err = esp_partition_read(delta->base_partition, src, delta->sector + delta->sector_len, n);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to read the installed image (%s)", esp_err_to_name(err));
+            return err;
+        }
+        delta->sector_len += n;
+        delta->produced += n;
+        src += n;
+        len -= n;
+        err = ota_delta_flush_if_full(delta);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ota_delta_data(ota_delta_t *delta, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = SPI_FLASH_SEC_SIZE - delta->sector_len;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(delta->sector + delta->sector_len, data, n);
+        delta->sector_len += n;
+        delta->produced += n;
+        data += n;
+        len -= n;
+        esp_err_t err = ota_delta_flush_if_full(delta);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_delta_feed(ota_delta_t *delta, const uint8_t *data, size_t len)
+{
+    esp_err_t err;
+    if (delta->header_len < OTA_DELTA_HEADER_SIZE)
+    {
+        // the header says which image the patch expects, check it before anything is overwritten
+        size_t n = OTA_DELTA_HEADER_SIZE - delta->header_len;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(delta->header + delta->header_len, data, n);
+        delta->header_len += n;
+        data += n;
+        len -= n;
+        if (delta->header_len < OTA_DELTA_HEADER_SIZE)
+        {
+            return ESP_OK;
+        }
+        err = ota_delta_parse_header(delta);
+        if (err == ESP_OK)
+        {
+            err = ota_delta_check_base(delta);
+        }
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        ESP_LOGI(TAG, "Applying patch: %u byte base -> %u byte image", (unsigned)delta->base_size, (unsigned)delta->target_size);
+    }
+    while (len > 0)
+    {
+        if (delta->data_left > 0)
+        {
+            size_t n = len < delta->data_left ? len : delta->data_left;
+            err = ota_delta_data(delta, data, n);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+            delta->data_left -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        if (delta->produced == delta->target_size)
+        {
+            ESP_LOGE(TAG, "Patch has %u bytes after the end of the image", (unsigned)len);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        // op headers can be split between two chunks
+        delta->op[delta->op_len++] = *data++;
+        len--;
+        size_t op_size = delta->op[0] == OTA_DELTA_OP_COPY ? 9 : 5;
+        if (delta->op[0] != OTA_DELTA_OP_COPY && delta->op[0] != OTA_DELTA_OP_DATA)
+        {
+            ESP_LOGE(TAG, "Patch has an unknown op 0x%02x", delta->op[0]);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (delta->op_len < op_size)
+        {
+            continue;
+        }
+        delta->op_len = 0;
+        if (delta->op[0] == OTA_DELTA_OP_COPY)
+        {
+            err = ota_delta_copy(delta, read_u32_le(&delta->op[1]), read_u32_le(&delta->op[5]));
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+        }
+        else
+        {
+            uint32_t data_len = read_u32_le(&delta->op[1]);
+            if (data_len > delta->target_size - delta->produced)
+            {
+                ESP_LOGE(TAG, "Patch DATA longer than the image");
+                return ESP_ERR_INVALID_SIZE;
+            }
+            delta->data_left = data_len;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_delta_finish(ota_delta_t *delta)
+{
+    if (delta->header_len < OTA_DELTA_HEADER_SIZE)
+    {
+        ESP_LOGE(TAG, "Patch ended in its header");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (delta->produced != delta->target_size || delta->data_left != 0 || delta->op_len != 0)
+    {
+        ESP_LOGE(TAG, "Patch ended after %u of %u bytes", (unsigned)delta->produced, (unsigned)delta->target_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (delta->sector_len == 0)
+    {
+        return ESP_OK;
+    }
+    esp_err_t err = delta->write_cb(delta->write_ctx, (const char *)delta->sector, delta->sector_len);
+    delta->sector_len = 0;
+    return err;
+}
+
+void ota_delta_free(ota_delta_t *delta)
+{
+    free(delta->sector);
+    delta->sector = NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef MYLIBOTADELTA_H
+#define MYLIBOTADELTA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "common.h"
+
+/*
+Patch format (little endian), generated by tools/ota_delta.py:
+    header: "OTD1" | u32 base_size | u8[32] sha256 of the base image | u32 target_size
+    ops until target_size bytes were produced:
+        0x00 COPY | u32 base_offset | u32 length   -> copies bytes of the installed image
+        0x01 DATA | u32 length | length bytes      -> literal bytes from the patch
+
+The patch is applied in place: the installed image lives in the same partition the new one is written to.
+The output is buffered one flash sector at a time, so a COPY may only read base bytes of sectors that were not
+flushed yet. The generator guarantees it and ota_delta_feed checks it.
+
+This makes copies forward only: once an insertion or a move towards the end of the image is larger than a sector,
+the base bytes the rest of the image would copy from are already overwritten, and everything after it becomes DATA.
+Such a patch is about as large as the image, so tools/ota_delta.py refuses to write a patch that is not clearly smaller
+than the (zlib packed) image and the manifest should not offer a delta_url for that version.
+*/
+
+#define OTA_DELTA_MAGIC "OTD1"
+#define OTA_DELTA_HEADER_SIZE (4 + 4 + 32 + 4)
+
+#define OTA_DELTA_OP_COPY 0x00
+#define OTA_DELTA_OP_DATA 0x01
+
+// called with every complete output sector (and the last partial one)
+typedef esp_err_t (*ota_delta_write_cb_t)(void *ctx, const char *data, size_t len);
+
+typedef struct ota_delta_t
+{
+    const esp_partition_t *base_partition;
+    uint32_t base_size;
+    uint8_t base_sha256[32];
+    uint32_t target_size;
+
+    ota_delta_write_cb_t write_cb;
+    void *write_ctx;
+
+    uint8_t header[OTA_DELTA_HEADER_SIZE];
+    size_t header_len;  // bytes of header received so far, the ops start once it is complete
+    uint8_t op[9];     // header of the current op (type + up to two u32)
+    size_t op_len;     // bytes of op received so far
+    uint32_t data_left; // literal bytes of the current DATA op still to come
+    uint32_t produced;  // bytes of the new image produced so far
+    uint8_t *sector;    // output sector being assembled
+    size_t sector_len;
+} ota_delta_t;
+
+// allocates the output sector, the base image is the one installed in base_partition
+esp_err_t ota_delta_init(ota_delta_t *delta, const esp_partition_t *base_partition,
+                         ota_delta_write_cb_t write_cb, void *write_ctx);
+
+// applies the next bytes of the patch (any length), complete sectors are passed to write_cb
+// once the header is complete it checks that the installed image is the one the patch was generated against
+// (ESP_ERR_INVALID_CRC if not), before anything is written
+esp_err_t ota_delta_feed(ota_delta_t *delta, const uint8_t *data, size_t len);
+
+// writes the last partial sector, returns an error if the patch did not produce the whole image
+esp_err_t ota_delta_finish(ota_delta_t *delta);
+
+// frees the output sector
+void ota_delta_free(ota_delta_t *delta);
+
+#endif
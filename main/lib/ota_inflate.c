@@ -0,0 +1,109 @@
+#include "ota_inflate.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+_Static_assert(OTA_INFLATE_WINDOW_BITS >= 8 && OTA_INFLATE_WINDOW_BITS <= 15, "OTA_INFLATE_WINDOW_BITS must be between 8 and 15");
+
+esp_err_t ota_inflate_init(ota_inflate_t *inflate, ota_inflate_write_cb_t write_cb, void *write_ctx)
+{
+    memset(inflate, 0, sizeof(ota_inflate_t));
+    inflate->write_cb = write_cb;
+    inflate->write_ctx = write_ctx;
+    inflate->window = (uint8_t *)malloc(OTA_INFLATE_WINDOW_SIZE);
+    if (inflate->window == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to allocate memory for the decompression window");
+        return ESP_ERR_NO_MEM;
+    }
+    tinfl_init(&inflate->decompressor);
+    return ESP_OK;
+}
+
+void ota_inflate_reset(ota_inflate_t *inflate)
+{
+    tinfl_init(&inflate->decompressor);
+    inflate->window_ofs = 0;
+    inflate->header_checked = false;
+    inflate->done = false;
+    inflate->consumed = 0;
+    inflate->produced = 0;
+}
+
+esp_err_t ota_inflate_feed(ota_inflate_t *inflate, const uint8_t *data, size_t len)
+{
+    if (len > 0 && inflate->done)
+    {
+        ESP_LOGE(TAG, "Compressed stream has %u bytes after its end", (unsigned)len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (len > 0 && !inflate->header_checked)
+    {
+        // CINFO in the high nibble of the first byte is log2(window) - 8
+        unsigned window_bits = (data[0] >> 4) + 8;
+        if ((data[0] & 0x0f) != 8 || window_bits > OTA_INFLATE_WINDOW_BITS)
+        {
+            ESP_LOGE(TAG, "Compressed stream is not zlib or needs a %u byte window (max %u)", 1U << window_bits, OTA_INFLATE_WINDOW_SIZE);
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        inflate->header_checked = true;
+    }
+
+    tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    // the output may still be pending after the last input byte was taken, so loop until tinfl asks for more
+    while (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT)
+    {
+        size_t in_bytes = len;
+        size_t out_bytes = OTA_INFLATE_WINDOW_SIZE - inflate->window_ofs;
+        status = tinfl_decompress(&inflate->decompressor, data, &in_bytes,
+                                  inflate->window, inflate->window + inflate->window_ofs, &out_bytes,
+                                  TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_bytes;
+        len -= in_bytes;
+        inflate->consumed += in_bytes;
+
+        if (out_bytes > 0)
+        {
+            esp_err_t err = inflate->write_cb(inflate->write_ctx, (const char *)inflate->window + inflate->window_ofs, out_bytes);
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+            inflate->produced += out_bytes;
+            inflate->window_ofs = (inflate->window_ofs + out_bytes) & (OTA_INFLATE_WINDOW_SIZE - 1);
+        }
+
+        if (status < TINFL_STATUS_DONE)
+        {
+            ESP_LOGE(TAG, "Compressed stream is corrupted (tinfl status %d at byte %u)", (int)status, (unsigned)inflate->consumed);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (status == TINFL_STATUS_DONE)
+        {
+            inflate->done = true;
+            if (len > 0)
+            {
+                ESP_LOGE(TAG, "Compressed stream has %u bytes after its end", (unsigned)len);
+                return ESP_ERR_INVALID_SIZE;
+            }
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t ota_inflate_finish(ota_inflate_t *inflate)
+{
+    if (!inflate->done)
+    {
+        ESP_LOGE(TAG, "Compressed stream ended early (%u bytes in, %u bytes out)", (unsigned)inflate->consumed, (unsigned)inflate->produced);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+void ota_inflate_free(ota_inflate_t *inflate)
+{
+    free(inflate->window);
+    inflate->window = NULL;
+}
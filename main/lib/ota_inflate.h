@@ -0,0 +1,62 @@
+#ifndef MYLIBOTAINFLATE_H
+#define MYLIBOTAINFLATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "miniz.h"
+#include "common.h"
+
+/*
+Compressed images are zlib streams (RFC 1950, "Content-Encoding: deflate" in HTTP), generated by tools/ota_pack.py.
+They are decompressed with the tinfl decoder of the ROM, so the stage adds no code to the updater.
+tinfl needs an output buffer as large as the deflate window of the stream, that buffer is the only
+large allocation: no part of the image is ever buffered beyond it.
+*/
+
+/**** CONFIGURATION ****/
+
+// log2 of the largest deflate window accepted, the window buffer is allocated with this size
+// 15 (32 KB) accepts any zlib stream, images packed with a smaller --wbits can use a smaller window
+#ifndef OTA_INFLATE_WINDOW_BITS
+#define OTA_INFLATE_WINDOW_BITS 15
+#endif
+
+/****               ****/
+
+#define OTA_INFLATE_WINDOW_SIZE (1U << OTA_INFLATE_WINDOW_BITS)
+
+// called with every run of decompressed bytes (at most OTA_INFLATE_WINDOW_SIZE at once)
+typedef esp_err_t (*ota_inflate_write_cb_t)(void *ctx, const char *data, size_t len);
+
+typedef struct ota_inflate_t
+{
+    tinfl_decompressor decompressor;
+    uint8_t *window;     // circular output buffer, also the history the stream refers back to
+    size_t window_ofs;   // where the next decompressed byte goes in window
+    bool header_checked; // the window size of the zlib header was checked
+    bool done;           // the end of the stream (and its adler32) was reached
+    size_t consumed;     // compressed bytes fed so far
+    size_t produced;     // decompressed bytes passed to write_cb so far
+
+    ota_inflate_write_cb_t write_cb;
+    void *write_ctx;
+} ota_inflate_t;
+
+// allocates the window and gets ready for the first byte of a stream
+esp_err_t ota_inflate_init(ota_inflate_t *inflate, ota_inflate_write_cb_t write_cb, void *write_ctx);
+
+// forgets the current stream, the next byte fed is the start of a new one
+void ota_inflate_reset(ota_inflate_t *inflate);
+
+// decompresses the next bytes of the stream (any length), the output is passed to write_cb
+esp_err_t ota_inflate_feed(ota_inflate_t *inflate, const uint8_t *data, size_t len);
+
+// returns an error if the stream ended before its last block
+esp_err_t ota_inflate_finish(ota_inflate_t *inflate);
+
+// frees the window
+void ota_inflate_free(ota_inflate_t *inflate);
+
+#endif
@@ -0,0 +1,83 @@
+#include "ota_ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+_Static_assert((OTA_RING_SLOTS & (OTA_RING_SLOTS - 1)) == 0, "OTA_RING_SLOTS must be a power of two");
+
+esp_err_t ota_ring_init(ota_ring_t *ring, size_t slot_size)
+{
+    memset(ring, 0, sizeof(ota_ring_t));
+    ring->slot_size = slot_size;
+    for (int i = 0; i < OTA_RING_SLOTS; i++)
+    {
+        // flash writes are faster from word aligned buffers
+        ring->slots[i].data = (uint8_t *)aligned_alloc(4, slot_size);
+        if (ring->slots[i].data == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to allocate memory for ring slot %d", i);
+            ota_ring_free(ring);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+void ota_ring_free(ota_ring_t *ring)
+{
+    for (int i = 0; i < OTA_RING_SLOTS; i++)
+    {
+        free(ring->slots[i].data);
+        ring->slots[i].data = NULL;
+    }
+}
+
+void ota_ring_attach(ota_ring_t *ring, TaskHandle_t producer, TaskHandle_t consumer)
+{
+    ring->producer = producer;
+    ring->consumer = consumer;
+}
+
+uint8_t *ota_ring_acquire_write(ota_ring_t *ring)
+{
+    // the notification count is kept if the consumer released a slot before we started waiting
+    while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == OTA_RING_SLOTS)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    return ring->slots[ring->head & (OTA_RING_SLOTS - 1)].data;
+}
+
+void ota_ring_commit_write(ota_ring_t *ring, size_t len)
+{
+    ring->slots[ring->head & (OTA_RING_SLOTS - 1)].len = len;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    xTaskNotifyGive(ring->consumer);
+}
+
+void ota_ring_close(ota_ring_t *ring)
+{
+    __atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+    xTaskNotifyGive(ring->consumer);
+}
+
+ota_ring_slot_t *ota_ring_acquire_read(ota_ring_t *ring)
+{
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+    {
+        // closed is set after the last commit so an empty closed ring is really finished
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+        {
+            return NULL;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    return &ring->slots[ring->tail & (OTA_RING_SLOTS - 1)];
+}
+
+void ota_ring_release_read(ota_ring_t *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    xTaskNotifyGive(ring->producer);
+}
@@ -0,0 +1,63 @@
+#ifndef MYLIBOTARING_H
+#define MYLIBOTARING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "common.h"
+
+// number of buffers in the ring, has to be a power of two
+#ifndef OTA_RING_SLOTS
+#define OTA_RING_SLOTS 4
+#endif
+
+// one buffer of the ring
+typedef struct ota_ring_slot_t
+{
+    uint8_t *data;
+    size_t len;
+} ota_ring_slot_t;
+
+// single producer / single consumer ring of fixed size buffers
+// the indexes are only ever written by one side so no lock is needed,
+// task notifications are only used to sleep while the ring is full/empty
+typedef struct ota_ring_t
+{
+    ota_ring_slot_t slots[OTA_RING_SLOTS];
+    size_t slot_size;
+    volatile uint32_t head; // number of slots committed by the producer
+    volatile uint32_t tail; // number of slots released by the consumer
+    volatile bool closed;   // producer will not commit any more slots
+    TaskHandle_t producer;
+    TaskHandle_t consumer;
+} ota_ring_t;
+
+// allocates OTA_RING_SLOTS buffers of slot_size bytes (word aligned) on the HEAP
+esp_err_t ota_ring_init(ota_ring_t *ring, size_t slot_size);
+
+// frees the buffers allocated by ota_ring_init
+void ota_ring_free(ota_ring_t *ring);
+
+// sets the tasks that will be notified when the ring changes
+// has to be called before any of the functions below are used
+void ota_ring_attach(ota_ring_t *ring, TaskHandle_t producer, TaskHandle_t consumer);
+
+// PRODUCER SIDE
+// returns the next free buffer (slot_size bytes), blocks while the ring is full
+uint8_t *ota_ring_acquire_write(ota_ring_t *ring);
+// publishes the buffer returned by ota_ring_acquire_write with len valid bytes
+void ota_ring_commit_write(ota_ring_t *ring, size_t len);
+// tells the consumer that no more data will come
+void ota_ring_close(ota_ring_t *ring);
+
+// CONSUMER SIDE
+// returns the next filled slot, blocks while the ring is empty
+// returns NULL when the ring is empty and was closed by the producer
+ota_ring_slot_t *ota_ring_acquire_read(ota_ring_t *ring);
+// gives the slot returned by ota_ring_acquire_read back to the producer
+void ota_ring_release_read(ota_ring_t *ring);
+
+#endif
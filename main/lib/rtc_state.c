@@ -0,0 +1,82 @@
+#include "rtc_state.h"
+#include <stddef.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+// not touched by the startup code, so it still holds the last run after esp_restart
+static RTC_NOINIT_ATTR rtc_state_t rtc_state;
+
+static uint32_t rtc_state_crc(const rtc_state_t *state)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)state, offsetof(rtc_state_t, crc));
+}
+
+static bool rtc_state_valid(void)
+{
+    return rtc_state.magic == RTC_STATE_MAGIC && rtc_state.layout == RTC_STATE_LAYOUT && rtc_state.crc == rtc_state_crc(&rtc_state);
+}
+
+// the system time keeps running over esp_restart, unlike esp_timer_get_time
+static int64_t rtc_now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+bool rtc_check_due(void)
+{
+#ifdef RTC_CHECK_INTERVAL_S
+    if (!rtc_state_valid())
+    {
+        ESP_LOGI(TAG, "No update check state in RTC memory -> checking");
+        return true;
+    }
+    int64_t elapsed_us = rtc_now_us() - rtc_state.last_check_us;
+    if (elapsed_us < 0)
+    {
+        // the application set the clock back
+        ESP_LOGI(TAG, "Clock went back since the last update check -> checking");
+        return true;
+    }
+    if (elapsed_us >= (int64_t)rtc_state.check_interval_s * 1000000)
+    {
+        ESP_LOGI(TAG, "Last update check %lld s ago, interval %u s -> checking", elapsed_us / 1000000, (unsigned)rtc_state.check_interval_s);
+        return true;
+    }
+    rtc_state.fast_boots++;
+    rtc_state.crc = rtc_state_crc(&rtc_state);
+    ESP_LOGI(TAG, "Last update check %lld s ago, next one in %lld s -> skipping it (%u boots since)", elapsed_us / 1000000,
+             (int64_t)rtc_state.check_interval_s - elapsed_us / 1000000, (unsigned)rtc_state.fast_boots);
+    return false;
+#else
+    return true;
+#endif
+}
+
+void rtc_check_done(uint32_t interval_s)
+{
+#ifdef RTC_CHECK_INTERVAL_S
+    if (interval_s == 0)
+    {
+        interval_s = rtc_state_valid() ? rtc_state.check_interval_s : RTC_CHECK_INTERVAL_S;
+    }
+    if (interval_s > RTC_CHECK_INTERVAL_MAX_S)
+    {
+        interval_s = RTC_CHECK_INTERVAL_MAX_S;
+    }
+    rtc_state.magic = RTC_STATE_MAGIC;
+    rtc_state.layout = RTC_STATE_LAYOUT;
+    rtc_state.last_check_us = rtc_now_us();
+    rtc_state.check_interval_s = interval_s;
+    rtc_state.fast_boots = 0;
+    rtc_state.crc = rtc_state_crc(&rtc_state);
+    ESP_LOGI(TAG, "Next update check in %u s", (unsigned)interval_s);
+#endif
+}
+
+void rtc_check_clear(void)
+{
+    rtc_state.magic = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef MYLIBRTCSTATE_H
+#define MYLIBRTCSTATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "common.h"
+
+/*
+State of the updater kept in RTC slow memory. It survives esp_restart and the run of the application in between,
+but not a power cycle or a reset of the RTC domain. It is checked with a magic and a crc, so garbage after power on
+(or an application that wrote over it) only costs one full version check.
+*/
+
+/**** CONFIGURATION ****/
+
+// comment out to run the full version check on every boot
+// when enabled a boot within this many seconds of a check that found the device up to date goes straight to ota_end,
+// without NVS, Wi-Fi or TLS. The manifest can set another interval with its "check_interval" field (seconds)
+#define RTC_CHECK_INTERVAL_S (15 * 60)
+// longest interval the manifest can set
+#define RTC_CHECK_INTERVAL_MAX_S (24 * 60 * 60)
+
+/****               ****/
+
+#define RTC_STATE_MAGIC 0x4f544152 // "OTAR"
+// bump when the layout of rtc_state_t changes
+#define RTC_STATE_LAYOUT 1
+
+typedef struct rtc_state_t
+{
+    uint32_t magic;            // RTC_STATE_MAGIC
+    uint32_t layout;           // RTC_STATE_LAYOUT
+    int64_t last_check_us;     // system time (gettimeofday) of the last check that found the device up to date
+    uint32_t check_interval_s; // seconds until the next check is due
+    uint32_t fast_boots;       // boots that skipped the check since then
+    uint32_t crc;              // crc32 of the fields above
+} rtc_state_t;
+
+// returns true if the version check has to run on this boot:
+// no valid state, the last check did not find the device up to date, the interval passed or the clock went back
+bool rtc_check_due(void);
+
+// the check found the device up to date, the next one is due in interval_s seconds
+// 0 keeps the interval of the last check (a 304 answer has no manifest), or RTC_CHECK_INTERVAL_S
+void rtc_check_done(uint32_t interval_s);
+
+// the next boot runs the check again (after an update or a failed check)
+void rtc_check_clear(void);
+
+#endif
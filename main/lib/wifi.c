@@ -1,9 +1,93 @@
 #include "wifi.h"
+#include "boot_timeline.h"
+#include "esp_mac.h"
+#include "esp_netif_net_stack.h"
+#include "lwip/dhcp.h"
+#include <sys/time.h>
 
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT BIT1
 static int s_retry_num = 0;
 static EventGroupHandle_t s_wifi_event_group;
+// association of this boot, written by the event handler before WIFI_CONNECTED_BIT
+static int64_t s_assoc_start_us;
+static int64_t s_assoc_us;
+static wifi_event_sta_connected_t s_connected_ap;
+// 1 while the attempt goes to the cached AP, 2 once it failed and the full scan took over
+static uint32_t s_ap_cache;
+// set by the first caller of wifi_wait_connected that sees the connection, only that one writes the report
+static bool s_assoc_reported;
+// IP acquisition of this boot, written by the event handler before WIFI_CONNECTED_BIT
+static esp_netif_t *s_sta_netif;
+static int64_t s_ip_start_us;
+static int64_t s_ip_us;
+static uint32_t s_ip_method;
+static esp_netif_ip_info_t s_ip_info;
+static wifi_lease_t s_lease;
+static bool s_lease_loaded;
+
+// set while a static lease is tried, cleared by wifi_lease_confirm, so a lease that broke the run is not applied again
+#define WIFI_LEASE_PENDING 0x4c454153 // "LEAS"
+static RTC_NOINIT_ATTR uint32_t s_static_lease_pending;
+
+// the system time keeps running over esp_restart, so the age of a lease is known until the next power cycle
+static int64_t wifi_now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+#ifdef WIFI_STATIC_LEASE
+// applies the cached lease as static config if it is still good for the AP just associated with
+static bool wifi_apply_static_lease(const uint8_t *bssid)
+{
+    if (!s_lease_loaded || memcmp(s_lease.bssid, bssid, sizeof(s_lease.bssid)) != 0)
+    {
+        return false;
+    }
+    if (s_static_lease_pending == WIFI_LEASE_PENDING)
+    {
+        ESP_LOGW(TAG, "Last run with the static lease did not reach the server -> DHCP");
+        return false;
+    }
+    int64_t age_us = wifi_now_us() - s_lease.obtained_us;
+    // a clock that went back (power cycle, the application set it) says nothing about the age
+    if (age_us < 0 || age_us / 1000000 + WIFI_LEASE_MARGIN_S >= s_lease.lease_s)
+    {
+        ESP_LOGI(TAG, "Cached lease expired or about to -> DHCP");
+        return false;
+    }
+    esp_netif_ip_info_t ip_info = {
+        .ip = {.addr = s_lease.ip},
+        .netmask = {.addr = s_lease.netmask},
+        .gw = {.addr = s_lease.gw},
+    };
+    // set_ip_info posts IP_EVENT_STA_GOT_IP like the DHCP client does
+    esp_err_t err = esp_netif_dhcpc_stop(s_sta_netif);
+    if (err == ESP_OK)
+    {
+        s_static_lease_pending = WIFI_LEASE_PENDING;
+        err = esp_netif_set_ip_info(s_sta_netif, &ip_info);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to apply the cached lease (%s) -> DHCP", esp_err_to_name(err));
+        s_static_lease_pending = 0;
+        esp_netif_dhcpc_start(s_sta_netif);
+        return false;
+    }
+    if (s_lease.dns != 0)
+    {
+        esp_netif_dns_info_t dns = {0};
+        dns.ip.u_addr.ip4.addr = s_lease.dns;
+        dns.ip.type = ESP_IPADDR_TYPE_V4;
+        esp_netif_set_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+    }
+    ESP_LOGI(TAG, "Applied the cached lease, %lld s of %u s left", (int64_t)s_lease.lease_s - age_us / 1000000, (unsigned)s_lease.lease_s);
+    return true;
+}
+#endif
 
 static void event_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data)
@@ -12,8 +96,42 @@ static void event_handler(void *arg, esp_event_base_t event_base,
     {
         esp_wifi_connect();
     }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        s_assoc_us = esp_timer_get_time() - s_assoc_start_us;
+        memcpy(&s_connected_ap, event_data, sizeof(s_connected_ap));
+        boot_phase_end(BOOT_PHASE_WIFI_ASSOC);
+        boot_phase_start(BOOT_PHASE_GOT_IP);
+        s_ip_start_us = esp_timer_get_time();
+        // after a reconnect a static lease stays applied
+        if (s_ip_method != 2)
+        {
+            // DHCP, set to 1 with the IP if the client kept the cached address
+            s_ip_method = 0;
+#ifdef WIFI_STATIC_LEASE
+            if (wifi_apply_static_lease(s_connected_ap.bssid))
+            {
+                s_ip_method = 2;
+            }
+#endif
+        }
+    }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
+        if (s_ap_cache == 1 && s_assoc_us == 0)
+        {
+            // the AP moved, changed or is gone -> the next attempts scan all channels like without a cache
+            ESP_LOGW(TAG, "Cached AP failed -> connecting with a full scan");
+            s_ap_cache = 2;
+            wifi_config_t wifi_config;
+            esp_wifi_get_config(WIFI_IF_STA, &wifi_config);
+            wifi_config.sta.bssid_set = false;
+            wifi_config.sta.channel = 0;
+            wifi_config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+            esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+            esp_wifi_connect();
+            return;
+        }
         if (s_retry_num < WIFI_MAXIMUM_RETRY)
         {
             esp_wifi_connect();
@@ -30,20 +148,125 @@ static void event_handler(void *arg, esp_event_base_t event_base,
     {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        boot_phase_end(BOOT_PHASE_GOT_IP);
+        // the first IP of the boot is the one measured and cached
+        if (s_ip_us == 0)
+        {
+            s_ip_us = esp_timer_get_time() - s_ip_start_us;
+            s_ip_info = event->ip_info;
+#if CONFIG_LWIP_DHCP_RESTORE_LAST_IP
+            // only what lwip did counts: the address came from the DHCP client and is the one of the cached lease
+            struct netif *netif = (struct netif *)esp_netif_get_netif_impl(s_sta_netif);
+            if (s_ip_method == 0 && s_lease_loaded && netif != NULL && dhcp_supplied_address(netif) &&
+                event->ip_info.ip.addr == s_lease.ip)
+            {
+                s_ip_method = 1;
+            }
+#endif
+        }
         s_retry_num = 0;
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
 
-void wifi_init_sta(char* wifissid_start, char* wifipass_start)
+// keeps the lease the DHCP client got, and the time a full DHCP took to compare the cached ones with
+static void wifi_connect_store_lease(void)
+{
+    static const char *methods[] = {"DHCP", "DHCP with the cached address", "static lease"};
+    if (s_ip_method != 0 && s_lease.full_dhcp_us > 0)
+    {
+        ESP_LOGI(TAG, "Got IP in %lld ms (%s), %lld ms saved against the last full DHCP", s_ip_us / 1000, methods[s_ip_method],
+                 (s_lease.full_dhcp_us - s_ip_us) / 1000);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Got IP in %lld ms (%s)", s_ip_us / 1000, methods[s_ip_method]);
+    }
+    if (s_ip_method == 2)
+    {
+        // the static lease is not renewed, it keeps its expiry
+        return;
+    }
+    wifi_lease_t lease = {0};
+    lease.full_dhcp_us = s_ip_method == 0 ? s_ip_us : s_lease.full_dhcp_us;
+    memcpy(lease.bssid, s_connected_ap.bssid, sizeof(lease.bssid));
+    lease.ip = s_ip_info.ip.addr;
+    lease.netmask = s_ip_info.netmask.addr;
+    lease.gw = s_ip_info.gw.addr;
+    esp_netif_dns_info_t dns;
+    if (esp_netif_get_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK)
+    {
+        lease.dns = dns.ip.u_addr.ip4.addr;
+    }
+    // from the start of the exchange, so the expiry errs on the early side
+    lease.obtained_us = wifi_now_us() - (esp_timer_get_time() - s_ip_start_us);
+    // offered_t0_lease is an lwip internal (no public getter), check it when moving to another IDF/lwip version
+    // read without the tcpip lock, the client does not touch the lease time until it renews after T1
+    struct netif *netif = (struct netif *)esp_netif_get_netif_impl(s_sta_netif);
+    struct dhcp *dhcp = netif != NULL ? netif_dhcp_data(netif) : NULL;
+    lease.lease_s = dhcp != NULL ? dhcp->offered_t0_lease : 0;
+    if (set_wifi_lease_nvs(&lease) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store the DHCP lease in NVS");
+    }
+}
+
+// stores the AP and the lease for the next connect and adds the association time to the histogram in NVS
+// runs in the task that waited for the connection, the stack of the event task is too small for NVS writes
+static void wifi_connect_report(void)
+{
+    ESP_LOGI(TAG, "Associated in %lld ms (%s)", s_assoc_us / 1000,
+             s_ap_cache == 1 ? "cached AP" : s_ap_cache == 2 ? "cached AP failed, full scan" : "full scan");
+#ifdef WIFI_FAST_RECONNECT
+    wifi_ap_cache_t ap = {0};
+    memcpy(ap.ssid, s_connected_ap.ssid, s_connected_ap.ssid_len < sizeof(ap.ssid) - 1 ? s_connected_ap.ssid_len : sizeof(ap.ssid) - 1);
+    memcpy(ap.bssid, s_connected_ap.bssid, sizeof(ap.bssid));
+    ap.channel = s_connected_ap.channel;
+    ap.authmode = (uint8_t)s_connected_ap.authmode;
+    wifi_ap_cache_t cached;
+    // only written when the AP changed, not on every boot
+    if (get_wifi_ap_nvs(&cached) != 0 || memcmp(&cached, &ap, sizeof(ap)) != 0)
+    {
+        if (set_wifi_ap_nvs(&ap) != ESP_OK)
+        {
+            ESP_LOGW(TAG, "Failed to store the AP in NVS");
+        }
+    }
+#endif
+
+    wifi_connect_store_lease();
+
+    static const int64_t bucket_limits_ms[WIFI_ASSOC_BUCKETS - 1] = {250, 500, 1000, 2000, 4000};
+    int bucket = 0;
+    while (bucket < WIFI_ASSOC_BUCKETS - 1 && s_assoc_us / 1000 >= bucket_limits_ms[bucket])
+    {
+        bucket++;
+    }
+    wifi_assoc_hist_t hist;
+    if (get_wifi_assoc_hist_nvs(&hist) != 0)
+    {
+        memset(&hist, 0, sizeof(hist));
+    }
+    uint32_t *counts = s_ap_cache == 1 ? hist.cached : hist.scanned;
+    counts[bucket]++;
+    if (set_wifi_assoc_hist_nvs(&hist) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store the association histogram in NVS");
+    }
+    ESP_LOGI(TAG, "Association times <250/<500/<1000/<2000/<4000/>=4000 ms: cached AP %u/%u/%u/%u/%u/%u, full scan %u/%u/%u/%u/%u/%u",
+             (unsigned)hist.cached[0], (unsigned)hist.cached[1], (unsigned)hist.cached[2], (unsigned)hist.cached[3], (unsigned)hist.cached[4], (unsigned)hist.cached[5],
+             (unsigned)hist.scanned[0], (unsigned)hist.scanned[1], (unsigned)hist.scanned[2], (unsigned)hist.scanned[3], (unsigned)hist.scanned[4], (unsigned)hist.scanned[5]);
+}
+
+void wifi_start_sta(char* wifissid_start, char* wifipass_start)
 {
     s_wifi_event_group = xEventGroupCreate();
 
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    s_sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -79,6 +302,20 @@ void wifi_init_sta(char* wifissid_start, char* wifipass_start)
     memcpy(wifi_config.sta.ssid, wifissid_start, WIFI_KEY_SIZE);
     memcpy(wifi_config.sta.password, wifipass_start, WIFI_KEY_SIZE);
     #endif
+    s_lease_loaded = get_wifi_lease_nvs(&s_lease) == 0;
+#ifdef WIFI_FAST_RECONNECT
+    // the first attempt goes straight to the AP of the last association, without scanning for it
+    wifi_ap_cache_t ap;
+    if (get_wifi_ap_nvs(&ap) == 0 && strncmp(ap.ssid, (char *)wifi_config.sta.ssid, sizeof(wifi_config.sta.ssid)) == 0)
+    {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, ap.bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = ap.channel;
+        wifi_config.sta.threshold.authmode = ap.authmode;
+        s_ap_cache = 1;
+        ESP_LOGI(TAG, "Connecting to the cached AP " MACSTR " on channel %u", MAC2STR(ap.bssid), ap.channel);
+    }
+#endif
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
     #ifdef USEEAP
@@ -87,10 +324,15 @@ void wifi_init_sta(char* wifissid_start, char* wifipass_start)
     ESP_ERROR_CHECK(esp_wifi_sta_enterprise_enable());
     ESP_LOGI(TAG, "EAP is enabled");
     #endif
+    boot_phase_start(BOOT_PHASE_WIFI_ASSOC);
+    s_assoc_start_us = esp_timer_get_time();
     ESP_ERROR_CHECK(esp_wifi_start());
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
+}
 
+void wifi_wait_connected(char* wifissid_start, char* wifipass_start)
+{
     /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
      * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
     EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
@@ -105,6 +347,10 @@ void wifi_init_sta(char* wifissid_start, char* wifipass_start)
     {
         ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
                  (char*)wifissid_start, (char*)wifipass_start);
+        if (!__atomic_exchange_n(&s_assoc_reported, true, __ATOMIC_ACQ_REL))
+        {
+            wifi_connect_report();
+        }
     }
     else if (bits & WIFI_FAIL_BIT)
     {
@@ -115,4 +361,27 @@ void wifi_init_sta(char* wifissid_start, char* wifipass_start)
     {
         ESP_LOGE(TAG, "UNEXPECTED EVENT");
     }
-}
\ No newline at end of file
+}
+
+void wifi_init_sta(char* wifissid_start, char* wifipass_start)
+{
+    wifi_start_sta(wifissid_start, wifipass_start);
+    wifi_wait_connected(wifissid_start, wifipass_start);
+}
+
+void wifi_assoc_stats(int64_t *assoc_us, uint32_t *ap_cache)
+{
+    *assoc_us = s_assoc_us;
+    *ap_cache = s_ap_cache;
+}
+
+void wifi_ip_stats(int64_t *ip_us, uint32_t *ip_method)
+{
+    *ip_us = s_ip_us;
+    *ip_method = s_ip_method;
+}
+
+void wifi_lease_confirm(void)
+{
+    s_static_lease_pending = 0;
+}
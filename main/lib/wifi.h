@@ -24,6 +24,17 @@
 #define WIFI_MAXIMUM_RETRY 5
 #define WIFI_KEY_SIZE 32
 
+// comment out to scan all channels on every connect
+// when enabled the BSSID, channel and auth mode of the last association are kept in NVS (device_creds/wifi_ap)
+// and the first attempt of the next connect goes straight to that AP, a full scan follows only if it fails
+#define WIFI_FAST_RECONNECT
+
+// comment out to run DHCP on every connect (with CONFIG_LWIP_DHCP_RESTORE_LAST_IP it requests the last address, INIT-REBOOT)
+// when enabled the last lease is applied as static config without any DHCP exchange, as long as it came from the same AP,
+// has more than WIFI_LEASE_MARGIN_S seconds left and the last run with a static lease reached the server (wifi_lease_confirm)
+#define WIFI_STATIC_LEASE
+#define WIFI_LEASE_MARGIN_S (10 * 60)
+
 
 
 
@@ -46,6 +57,22 @@
 // This function should be called before any other wifi function
 void wifi_init_sta(char* wifissid_start, char* wifipass_start);
 
+// wifi_init_sta in two halves, so other work can run while the station associates and gets its IP
+// starts the station and the association, returns once the radio is up
+void wifi_start_sta(char* wifissid_start, char* wifipass_start);
+// blocks until the station got an IP or gave up after WIFI_MAXIMUM_RETRY attempts
+void wifi_wait_connected(char* wifissid_start, char* wifipass_start);
+
+// IP acquisition time of this boot and how the address was obtained (0 DHCP, 1 DHCP kept the cached address, 2 static lease)
+void wifi_ip_stats(int64_t *ip_us, uint32_t *ip_method);
+
+// the network worked with the address of this boot, a static lease is used again on the next boots
+// a static lease that was never confirmed (the run failed) is not applied again, the next boot runs DHCP
+void wifi_lease_confirm(void);
+
+// association time of this boot and how the AP was found (0 full scan, 1 cached AP, 2 cached AP failed then full scan)
+void wifi_assoc_stats(int64_t *assoc_us, uint32_t *ap_cache);
+
 static void event_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data);
 
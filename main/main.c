@@ -16,52 +16,74 @@
 #include "lib/gen_auth.h"
 #include "lib/ota.h"
 #include "lib/https.h"
+#include "lib/rtc_state.h"
+#include "lib/boot_timeline.h"
+#include "lib/boot_sched.h"
 
 #define DEVICE_ID_SIZE 25
 
 const char *TAG = "OTA_UPDATER";
 
-void app_main(void)
+// state the boot jobs hand to each other, every field is written by one job and read only by the jobs that depend on it
+typedef struct boot_ctx_t
 {
-    esp_err_t err;
+    char *ssid_buf;
+    char *pass_buf;
+    char *device_id_buf;
+    char *cert_buf;
+    char *key_buf;
+    char *csr_buf; // set if the device has no cert and key yet and has to enroll
+    bool enroll;   // written by the auth job only, the jobs after it choose the enrollment or the stored credentials with it
+    https_creds_t creds;
+    char *version_buf1;
+    int found_version_flag;
+    char version_buf2[VERSION_BUF_SIZE];
+    char url_buf[URL_BUF_SIZE];
+    ota_manifest_t manifest;
+    ota_metrics_t metrics; // timings of this run, stored in NVS for comparing sites
+    int ver_comp_result;
+} boot_ctx_t;
 
-    // just for precaution if some weird bug happens then we at least have one ota partion marked as valid
-    err = esp_ota_mark_app_valid_cancel_rollback();
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "esp_ota_mark_app_valid_cancel_rollback failed (%s)!", esp_err_to_name(err));
-        // you can make it can either restart esp or do some other things like warn the server if wanted
-        // cause this error indicates there something corrupeted or worng with the ota partitions ota_data
-    }
+// over a kilobyte with the manifest, kept off the stack of the main task
+static boot_ctx_t boot_ctx;
 
+static void job_nvs_init(void *arg)
+{
+    boot_phase_start(BOOT_PHASE_NVS_INIT);
     init_nvs();
-    char *ssid_buf = malloc(WIFI_KEY_SIZE);
-    char *pass_buf = malloc(WIFI_KEY_SIZE);
-    char *device_id_buf = malloc(DEVICE_ID_SIZE);
-    int found_wifi_flag = get_wifi_id_nvs(&ssid_buf, WIFI_KEY_SIZE, &pass_buf, WIFI_KEY_SIZE, &device_id_buf, DEVICE_ID_SIZE);
+    boot_phase_end(BOOT_PHASE_NVS_INIT);
+}
+
+static void job_wifi_creds(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    boot_phase_start(BOOT_PHASE_WIFI_CREDS);
+    ctx->ssid_buf = malloc(WIFI_KEY_SIZE);
+    ctx->pass_buf = malloc(WIFI_KEY_SIZE);
+    ctx->device_id_buf = malloc(DEVICE_ID_SIZE);
+    int found_wifi_flag = get_wifi_id_nvs(&ctx->ssid_buf, WIFI_KEY_SIZE, &ctx->pass_buf, WIFI_KEY_SIZE, &ctx->device_id_buf, DEVICE_ID_SIZE);
     if (found_wifi_flag == 0)
     {
         ESP_LOGW(TAG, "WiFi credentials found in NVS");
-        ESP_LOGI(TAG, "SSID: %s", ssid_buf);
-        ESP_LOGI(TAG, "Password: %s", pass_buf);
-        ESP_LOGI(TAG, "Device ID: %s", device_id_buf);
+        ESP_LOGI(TAG, "SSID: %s", ctx->ssid_buf);
+        ESP_LOGI(TAG, "Password: %s", ctx->pass_buf);
+        ESP_LOGI(TAG, "Device ID: %s", ctx->device_id_buf);
     }
     else if (found_wifi_flag == -1)
     {
         ESP_LOGW(TAG, "WiFi credentials NOT found in NVS");
         ESP_LOGW(TAG, "Will set the device credentials for the first time in NVS");
         set_device_creds_nvs();
-        int found_wifi_flag = get_wifi_id_nvs(&ssid_buf, WIFI_KEY_SIZE, &pass_buf, WIFI_KEY_SIZE, &device_id_buf, DEVICE_ID_SIZE);
+        int found_wifi_flag = get_wifi_id_nvs(&ctx->ssid_buf, WIFI_KEY_SIZE, &ctx->pass_buf, WIFI_KEY_SIZE, &ctx->device_id_buf, DEVICE_ID_SIZE);
         if (found_wifi_flag != 0)
         {
             ESP_LOGE(TAG, "Failed to get credentials from NVS after just setting them");
             task_fatal_error();
         }
         ESP_LOGW(TAG, "WiFi credentials found in NVS (we have just set them,this is first boot)");
-        ESP_LOGI(TAG, "SSID: %s", ssid_buf);
-        ESP_LOGI(TAG, "Password: %s", pass_buf);
-        ESP_LOGI(TAG, "Device ID: %s", device_id_buf);
-
+        ESP_LOGI(TAG, "SSID: %s", ctx->ssid_buf);
+        ESP_LOGI(TAG, "Password: %s", ctx->pass_buf);
+        ESP_LOGI(TAG, "Device ID: %s", ctx->device_id_buf);
     }
     else
     {
@@ -69,143 +91,368 @@ void app_main(void)
         // unrecoverable error, restart the esp32
         task_fatal_error();
     }
+    boot_phase_end(BOOT_PHASE_WIFI_CREDS);
+}
 
-    wifi_init_sta(ssid_buf, pass_buf);
-    free(ssid_buf);
-    free(pass_buf);
-    print_stack_size();
-    // 
+static void job_wifi_start(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    wifi_start_sta(ctx->ssid_buf, ctx->pass_buf);
+}
+
+static void job_wifi_connect(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    wifi_wait_connected(ctx->ssid_buf, ctx->pass_buf);
+}
+
+// the connections of the enrollment and the version check then find both hosts in the lwip cache
+static void job_dns(void *arg)
+{
+    int64_t version_us = https_resolve_host(GET_VERSION_URL);
+    int64_t register_us = https_resolve_host(GET_CRT_URL);
+    ESP_LOGI(TAG, "Resolved the server hosts in %lld ms (version) and %lld ms (registration)", version_us / 1000, register_us / 1000);
+}
+
+// runs once the radio is up, so the key is generated with the hardware RNG fed by the RF noise
+static void job_auth(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    boot_phase_start(BOOT_PHASE_AUTH);
     // for retriving auth data from nvs we need to allocate memory for the buffers first
-    char *cert_buf = malloc(CLIENT_CERT_BUF_SIZE);
-    char *key_buf = malloc(KEY_BUF_SIZE);
+    ctx->cert_buf = malloc(CLIENT_CERT_BUF_SIZE);
+    ctx->key_buf = malloc(KEY_BUF_SIZE);
 
-    int ret = get_auth_nvs(&key_buf, KEY_BUF_SIZE, &cert_buf, CSR_BUF_SIZE);
+    int ret = get_auth_nvs(&ctx->key_buf, KEY_BUF_SIZE, &ctx->cert_buf, CSR_BUF_SIZE);
     if (ret == 0)
     {
         ESP_LOGI(TAG, "Successfully retrieved cert and priv key from NVS");
+        return;
     }
-    else
+    // If desired, we can implement different behaviors for when the data is not found or when there is an error in the NVS.
+    // For example, if the data is not found, we can create the data, and if there is an error, we can simply restart the ESP32 and try again.
+    // The specific behavior depends on the design case.
+    // Currently, we have the same behavior for both cases: printing the error, freeing the allocated memory, generating new keys, and storing them in the NVS.
+    ESP_LOGE(TAG, "Failed to retrieve cert and priv key from NVS");
+
+    // because it failed we can delete the key buffer and generate a new one(the generate_auth_stuff function will allocate memory for it for you this next time)
+    // cert_buf is kept, send_csr parses the certificate straight into it
+    free(ctx->key_buf);
+    ctx->key_buf = NULL;
+
+    esp_err_t err = generate_auth_stuff(&ctx->csr_buf, &ctx->key_buf);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to generate csr and priv key, %s", esp_err_to_name(err));
+        // unrecoverable error, restart the esp32
+        task_fatal_error();
+    }
+    ESP_LOGI(TAG, "Sucessfully generated csr and priv key key!");
+    ctx->enroll = true;
+}
+
+static void job_enroll(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    if (!ctx->enroll)
+    {
+        return;
+    }
+    boot_phase_start(BOOT_PHASE_ENROLL);
+    esp_err_t err = send_csr(ctx->csr_buf, ctx->cert_buf, CLIENT_CERT_BUF_SIZE, ctx->device_id_buf);
+    boot_phase_end(BOOT_PHASE_ENROLL);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to send csr to server and get cert, %s", esp_err_to_name(err));
+        // unrecoverable error, restart the esp32
+        task_fatal_error();
+    }
+    free(ctx->csr_buf);
+    ctx->csr_buf = NULL;
+    ESP_LOGI(TAG, "Successfully got certificate from server with csr");
+    err = set_auth_nvs(ctx->cert_buf, ctx->key_buf);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to store auth data in NVS, %s", esp_err_to_name(err));
+        // unrecoverable error, restart the esp32
+        task_fatal_error();
+    }
+    ESP_LOGI(TAG, "Successfully stored cert and priv key in NVS");
+}
+
+static void boot_creds_load(boot_ctx_t *ctx)
+{
+    // every connection of this run uses the decoded credentials, the PEM strings are not needed anymore
+    esp_err_t err = https_creds_load(&ctx->creds, ctx->cert_buf, ctx->key_buf);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to load the cert and priv key, %s", esp_err_to_name(err));
+        // unrecoverable error, restart the esp32
+        task_fatal_error();
+    }
+    free(ctx->cert_buf);
+    free(ctx->key_buf);
+    ctx->cert_buf = NULL;
+    ctx->key_buf = NULL;
+    ctx->metrics.key_type = ctx->creds.key_type;
+    boot_phase_end(BOOT_PHASE_AUTH);
+}
+
+// stored credentials are decoded while the station associates
+static void job_creds(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    if (!ctx->enroll)
     {
-        // If desired, we can implement different behaviors for when the data is not found or when there is an error in the NVS.
-        // For example, if the data is not found, we can create the data, and if there is an error, we can simply restart the ESP32 and try again.
-        // The specific behavior depends on the design case.
-        // Currently, we have the same behavior for both cases: printing the error, freeing the allocated memory, generating new keys, and storing them in the NVS.
-        ESP_LOGE(TAG, "Failed to retrieve cert and priv key from NVS");
+        boot_creds_load(ctx);
+    }
+}
 
-        // because it failed we can delete the buffers and generate new ones(the generate_auth_stuff function will allocate memory for the buffers for you this next time)
-        free(cert_buf);
-        free(key_buf);
+// the ones of the first boot only exist once the enrollment got the certificate
+static void job_enrolled_creds(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    if (ctx->enroll)
+    {
+        boot_creds_load(ctx);
+    }
+}
 
-        char *csr_buf = NULL;
+static void job_version_nvs(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    ctx->version_buf1 = calloc(1, VERSION_BUF_SIZE);
+    ctx->found_version_flag = get_version_from_nvs(&ctx->version_buf1, VERSION_BUF_SIZE);
+}
 
-        err = generate_auth_stuff(&csr_buf, &key_buf);
+/*
+We are going now to compare the version of the current firmware with the version of the firmware on the server.
+In this case we are just updating if it is a newer version on the server. This means if you rollback a version on the server the esp32 wont update to the older version.
+*/
+static void job_version_check(void *arg)
+{
+    boot_ctx_t *ctx = (boot_ctx_t *)arg;
+    esp_err_t err;
+    ctx->ver_comp_result = -1; // this means if we dont find any version on nvs or get an error retrieving it fomr nvs we will update the ota by default
+    if (ctx->found_version_flag == 0)
+    {
+        ESP_LOGI(TAG, "Version in NVS (current version): %s", ctx->version_buf1);
+        // only stored once the device was up to date with a manifest, so a 304 means there is nothing to do
+        manifest_validator_t cached_validator;
+        bool have_validator = get_manifest_validator_nvs(&cached_validator) == 0;
+        boot_phase_start(BOOT_PHASE_VERSION_CHECK);
+        err = get_version_api(&ctx->creds, have_validator ? &cached_validator : NULL, ctx->version_buf2, ctx->url_buf, &ctx->manifest, &ctx->metrics);
+        boot_phase_end(BOOT_PHASE_VERSION_CHECK);
         if (err != ESP_OK)
         {
-            ESP_LOGE(TAG, "Failed to generate csr and priv key, %s", esp_err_to_name(err));
+            ESP_LOGE(TAG, "Failed to get version from API: %s", esp_err_to_name(err));
             // unrecoverable error, restart the esp32
             task_fatal_error();
         }
-
-        ESP_LOGI(TAG, "Sucessfully generated csr and priv key key!");
-
-        err = send_csr(csr_buf, &cert_buf, device_id_buf);
-        if (err != ESP_OK)
+        if (ctx->manifest.not_modified)
         {
-            ESP_LOGE(TAG, "Failed to send csr to server and get cert, %s", esp_err_to_name(err));
-            // unrecoverable error, restart the esp32
-            task_fatal_error();
+            ESP_LOGI(TAG, "Server manifest did not change since the last check-> no need to update ota!");
+            ctx->ver_comp_result = 0;
         }
-        free(csr_buf);
-        free(device_id_buf);
-        ESP_LOGI(TAG, "Successfully got certificate from server with csr");
-        err = set_auth_nvs(cert_buf, key_buf);
+        else
+        {
+            ESP_LOGI(TAG, "successfully got data from API");
+            ESP_LOGI(TAG, "(server)Version: %s", ctx->version_buf2);
+            ESP_LOGI(TAG, "URL: %s", ctx->url_buf);
+            ctx->ver_comp_result = compare_versions(ctx->version_buf1, ctx->version_buf2); // will return -1 if current version is older then server version
+            if (ctx->ver_comp_result == 0 || ctx->ver_comp_result == 1)
+            {
+                ESP_LOGI(TAG, "Current version is the same or newer then the server version-> no need to update ota!");
+            }
+        }
+    } // first boot probably we dont have the version in the nvs-> still need to get the url from server
+    else if (ctx->found_version_flag == -1)
+    {
+        boot_phase_start(BOOT_PHASE_VERSION_CHECK);
+        err = get_version_api(&ctx->creds, NULL, ctx->version_buf2, ctx->url_buf, &ctx->manifest, &ctx->metrics);
+        boot_phase_end(BOOT_PHASE_VERSION_CHECK);
         if (err != ESP_OK)
         {
-            ESP_LOGE(TAG, "Failed to store auth data in NVS, %s", esp_err_to_name(err));
+            ESP_LOGE(TAG, "Failed to get version from API");
             // unrecoverable error, restart the esp32
             task_fatal_error();
         }
-        ESP_LOGI(TAG, "Successfully stored cert and priv key in NVS");
+        ESP_LOGI(TAG, "successfully got data from API");
+        ESP_LOGI(TAG, "(server)Version: %s", ctx->version_buf2);
+        ESP_LOGI(TAG, "URL: %s", ctx->url_buf);
     }
+}
 
-    /*
-    We are going now to compare the version of the current firmware with the version of the firmware on the server.
-    In this case we are just updating if it is a newer version on the server. This means if you rollback a version on the server the esp32 wont update to the older version.
-    */
+enum
+{
+    BOOT_JOB_NVS_INIT,
+    BOOT_JOB_WIFI_CREDS,
+    BOOT_JOB_WIFI_START,
+    BOOT_JOB_WIFI_CONNECT,
+    BOOT_JOB_DNS,
+    BOOT_JOB_AUTH,
+    BOOT_JOB_CREDS,
+    BOOT_JOB_ENROLL,
+    BOOT_JOB_ENROLLED_CREDS,
+    BOOT_JOB_VERSION_NVS,
+    BOOT_JOB_VERSION_CHECK,
+    BOOT_JOB_COUNT
+};
 
-    char *version_buf2 = NULL;
+// the table order is the old serial flow, the Wi-Fi jobs run on the core of the Wi-Fi/lwip tasks and the mbedtls ones on the other
+static boot_job_t boot_jobs[BOOT_JOB_COUNT] = {
+    [BOOT_JOB_NVS_INIT] = {"nvs_init", job_nvs_init, 0, BOOT_JOB_STACK_SIZE, tskNO_AFFINITY},
+    [BOOT_JOB_WIFI_CREDS] = {"wifi_creds", job_wifi_creds, BOOT_JOB_BIT(BOOT_JOB_NVS_INIT), BOOT_JOB_STACK_SIZE, tskNO_AFFINITY},
+    [BOOT_JOB_WIFI_START] = {"wifi_start", job_wifi_start, BOOT_JOB_BIT(BOOT_JOB_WIFI_CREDS), BOOT_JOB_STACK_SIZE, OTA_NET_CORE},
+    [BOOT_JOB_WIFI_CONNECT] = {"wifi_connect", job_wifi_connect, BOOT_JOB_BIT(BOOT_JOB_WIFI_START), BOOT_JOB_STACK_SIZE, OTA_NET_CORE},
+    [BOOT_JOB_DNS] = {"dns", job_dns, BOOT_JOB_BIT(BOOT_JOB_WIFI_CONNECT), BOOT_JOB_STACK_SIZE, OTA_NET_CORE},
+    // not before the radio is up, esp_random is only a true RNG with the RF on
+    [BOOT_JOB_AUTH] = {"auth", job_auth, BOOT_JOB_BIT(BOOT_JOB_WIFI_START), BOOT_JOB_TLS_STACK_SIZE, OTA_FLASH_CORE},
+    // either creds (stored credentials) or enroll and enrolled_creds (first boot) do the work, the others return at once
+    [BOOT_JOB_CREDS] = {"creds", job_creds, BOOT_JOB_BIT(BOOT_JOB_AUTH), BOOT_JOB_TLS_STACK_SIZE, OTA_FLASH_CORE},
+    [BOOT_JOB_ENROLL] = {"enroll", job_enroll, BOOT_JOB_BIT(BOOT_JOB_AUTH) | BOOT_JOB_BIT(BOOT_JOB_WIFI_CONNECT), BOOT_JOB_TLS_STACK_SIZE, tskNO_AFFINITY},
+    [BOOT_JOB_ENROLLED_CREDS] = {"enrolled_creds", job_enrolled_creds, BOOT_JOB_BIT(BOOT_JOB_ENROLL), BOOT_JOB_TLS_STACK_SIZE, OTA_FLASH_CORE},
+    [BOOT_JOB_VERSION_NVS] = {"version_nvs", job_version_nvs, BOOT_JOB_BIT(BOOT_JOB_NVS_INIT), BOOT_JOB_STACK_SIZE, tskNO_AFFINITY},
+    [BOOT_JOB_VERSION_CHECK] = {"version_check", job_version_check,
+                                BOOT_JOB_BIT(BOOT_JOB_CREDS) | BOOT_JOB_BIT(BOOT_JOB_ENROLLED_CREDS) | BOOT_JOB_BIT(BOOT_JOB_DNS) |
+                                BOOT_JOB_BIT(BOOT_JOB_VERSION_NVS),
+                                BOOT_JOB_TLS_STACK_SIZE, tskNO_AFFINITY},
+};
 
-    char *version_buf1 = calloc(1, VERSION_BUF_SIZE);
-    int found_version_flag = get_version_from_nvs(&version_buf1, VERSION_BUF_SIZE);
+void app_main(void)
+{
+    esp_err_t err;
 
-    int ver_comp_result = -1; // this means if we dont find any version on nvs or get an error retrieving it fomr nvs we will update the ota by default
-    char *url_buf = NULL;
-    if (found_version_flag == 0)
+    // just for precaution if some weird bug happens then we at least have one ota partion marked as valid
+    err = esp_ota_mark_app_valid_cancel_rollback();
+    if (err != ESP_OK)
     {
-        ESP_LOGI(TAG, "Version in NVS (current version): %s", version_buf1);
-        err = get_version_api(cert_buf, key_buf, &version_buf2, &url_buf);
-        if (err != ESP_OK)
-        {
-            ESP_LOGE(TAG, "Failed to get version from API: %s", esp_err_to_name(err));
-            // unrecoverable error, restart the esp32
-            task_fatal_error();
-        }
-        ESP_LOGI(TAG, "successfully got data from API");
-        ESP_LOGI(TAG, "(server)Version: %s", version_buf2);
-        ESP_LOGI(TAG, "URL: %s", url_buf);
-        ver_comp_result = compare_versions(version_buf1, version_buf2); // will return -1 if current version is older then server version
-        if (ver_comp_result == 0 || ver_comp_result == 1)
+        ESP_LOGE(TAG, "esp_ota_mark_app_valid_cancel_rollback failed (%s)!", esp_err_to_name(err));
+        // you can make it can either restart esp or do some other things like warn the server if wanted
+        // cause this error indicates there something corrupeted or worng with the ota partitions ota_data
+    }
+
+    // a recent check found the device up to date -> straight back to the application, without NVS, Wi-Fi or TLS
+    if (!rtc_check_due())
+    {
+        ota_config_t ota_config = {0};
+        ota_config.update_partition = esp_ota_get_next_update_partition(NULL);
+        if (ota_config.update_partition != NULL)
         {
-            ESP_LOGI(TAG, "Current version is the same or newer then the server version-> no need to update ota!");
+            ota_end(&ota_config);
+            ESP_LOGI(TAG, "Prepare to restart system!");
+            esp_restart();
         }
-    } // first boot probably we dont have the version in the nvs-> still need to get the url from server
-    else if (found_version_flag == -1)
+        // the full run below reports the missing partition
+    }
+
+    // the boot jobs run as soon as their inputs are ready, instead of one after another
+    err = boot_sched_run(boot_jobs, BOOT_JOB_COUNT, &boot_ctx);
+    if (err != ESP_OK)
     {
+        ESP_LOGE(TAG, "Failed to run the boot jobs, %s", esp_err_to_name(err));
+        // unrecoverable error, restart the esp32
+        task_fatal_error();
+    }
+    // the version check reached the server, so the address of this boot works
+    wifi_lease_confirm();
+    free(boot_ctx.ssid_buf);
+    free(boot_ctx.pass_buf);
+    free(boot_ctx.device_id_buf);
+    print_stack_size();
 
-        err = get_version_api(cert_buf, key_buf, &version_buf2, &url_buf);
-        if (err != ESP_OK)
+    // older builds stored the version before the download, so an interrupted download of it would otherwise never be finished
+    if (boot_ctx.ver_comp_result != -1 && ota_resume_pending(boot_ctx.version_buf2))
+    {
+        ESP_LOGW(TAG, "Found an interrupted download of the server version -> will resume it");
+        boot_ctx.ver_comp_result = -1;
+    }
+    else if (boot_ctx.ver_comp_result != -1 && !boot_ctx.manifest.not_modified)
+    {
+        // up to date with this manifest, the next check can be answered with a 304
+        if (set_manifest_validator_nvs(&boot_ctx.manifest.validator) != ESP_OK)
         {
-            ESP_LOGE(TAG, "Failed to get version from API");
-            // unrecoverable error, restart the esp32
-            task_fatal_error();
+            ESP_LOGW(TAG, "Failed to store the manifest validator in NVS");
         }
-        ESP_LOGI(TAG, "successfully got data from API");
-        ESP_LOGI(TAG, "(server)Version: %s", version_buf2);
-        ESP_LOGI(TAG, "URL: %s", url_buf);
     }
 
     ota_config_t ota_config;
     ota_begin(&ota_config);
-    if (ver_comp_result == -1 && url_buf != NULL && version_buf2 != NULL)
+    if (boot_ctx.ver_comp_result == -1 && boot_ctx.url_buf[0] != '\0' && boot_ctx.version_buf2[0] != '\0')
     {
-        ESP_LOGI(TAG, "settign version in nvs %s", version_buf2);
-        err = set_version_in_nvs(version_buf2);
-        if (err != ESP_OK)
+        // a patch only fits the image it was generated against, which is the one whose version is in NVS
+        bool use_delta = false;
+        if (boot_ctx.found_version_flag == 0 && boot_ctx.manifest.delta_url[0] != '\0' && boot_ctx.manifest.delta_base[0] != '\0' &&
+            strcmp(boot_ctx.manifest.delta_base, boot_ctx.version_buf1) == 0)
         {
-            ESP_LOGE(TAG, "Failed to store version in NVS,%s", esp_err_to_name(err));
-            ESP_LOGW(TAG, "Will continue with the update process anyways");
-        }
-        else
-        {
-            ESP_LOGI(TAG, "Successfully stored version in NVS");
+            ESP_LOGI(TAG, "Server offers a patch from version %s: %s", boot_ctx.manifest.delta_base, boot_ctx.manifest.delta_url);
+            use_delta = true;
         }
 
         ESP_LOGI(TAG, "Current version is older than server version-> will update ota!");
-        err = ota_update(cert_buf, key_buf, url_buf, &ota_config);
+#ifdef OTA_CIPHER_SWEEP
+        ota_cipher_sweep(&boot_ctx.creds, boot_ctx.url_buf, &ota_config);
+#endif
+#ifdef OTA_CHUNK_SWEEP
+        ota_chunk_sweep(&boot_ctx.creds, boot_ctx.url_buf, &ota_config);
+#endif
+        boot_phase_start(BOOT_PHASE_DOWNLOAD);
+        err = ota_update(&boot_ctx.creds, boot_ctx.url_buf, boot_ctx.version_buf2, &boot_ctx.manifest, use_delta, &ota_config, &boot_ctx.metrics);
+        boot_phase_end(BOOT_PHASE_DOWNLOAD);
         if (err != ESP_OK)
         {
             ESP_LOGE(TAG, "Failed to to donwload or update ota");
             // unrecoverable error, restart the esp32
             task_fatal_error();
         }
-    }
-    free(version_buf1);
-    free(version_buf2);
 
-    free(url_buf);
-    free(cert_buf);
-    free(key_buf);
+        // stored only after the download, the version in NVS has to describe the image that is really installed
+        // because delta updates are generated against it
+        ESP_LOGI(TAG, "settign version in nvs %s", boot_ctx.version_buf2);
+        err = set_version_in_nvs(boot_ctx.version_buf2);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to store version in NVS,%s", esp_err_to_name(err));
+            ESP_LOGW(TAG, "Will continue with the update process anyways");
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Successfully stored version in NVS");
+            // same as above, the device is up to date with this manifest now
+            if (set_manifest_validator_nvs(&boot_ctx.manifest.validator) != ESP_OK)
+            {
+                ESP_LOGW(TAG, "Failed to store the manifest validator in NVS");
+            }
+        }
+    }
+    free(boot_ctx.version_buf1);
+    // the clients of the version check and the download hold the credentials
+    https_conn_close_all();
+    https_creds_free(&boot_ctx.creds);
+    int64_t boot_set_start_time = esp_timer_get_time();
+    boot_phase_start(BOOT_PHASE_OTA_END);
     ota_end(&ota_config);
+    boot_phase_end(BOOT_PHASE_OTA_END);
+    boot_ctx.metrics.boot_set_us = esp_timer_get_time() - boot_set_start_time;
+    https_trust_stats(&boot_ctx.metrics.tls_pinned, &boot_ctx.metrics.tls_bundle, &boot_ctx.metrics.tls_verify_us);
+    wifi_assoc_stats(&boot_ctx.metrics.wifi_assoc_us, &boot_ctx.metrics.wifi_ap_cache);
+    wifi_ip_stats(&boot_ctx.metrics.wifi_ip_us, &boot_ctx.metrics.wifi_ip_method);
+    boot_ctx.metrics.layout = OTA_METRICS_LAYOUT;
+    ota_log_metrics(&boot_ctx.metrics);
+    if (set_ota_metrics_nvs(&boot_ctx.metrics) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store the ota metrics in NVS");
+    }
+    // after an update the next boot checks again, the server then confirms the new version with a 304
+    if (boot_ctx.ver_comp_result == -1)
+    {
+        rtc_check_clear();
+    }
+    else
+    {
+        rtc_check_done(boot_ctx.manifest.not_modified ? 0 : boot_ctx.manifest.check_interval);
+    }
+    boot_timeline_store();
     ESP_LOGI(TAG, "Everything was excuted successfully!");
     ESP_LOGI(TAG, "Prepare to restart system!");
     esp_restart();
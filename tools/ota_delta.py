@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""
+Generates the patches used by the delta update mode of the updater (see main/lib/ota_delta.h).
+
+    python tools/ota_delta.py <installed.bin> <new.bin> <patch.bin>
+
+The patch is applied in place on the esp32 (the installed image and the new one share the ota_1 partition),
+so a COPY may only read bytes of the installed image that were not overwritten yet:
+the device buffers one 4 KB sector of output, so a COPY starting at output offset o may read from
+src >= o rounded down to a sector, and may only cross an output sector boundary if src >= o.
+Copies can only go forward, so an insertion or a move towards the end of the image turns what follows it into
+literal data. If the patch is not clearly smaller than the image (at most MAX_PATCH_RATIO of it, both zlib packed
+like tools/ota_pack.py does) no patch is written and the tool exits with status 2: leave "delta_url" out of the manifest then, the full image is faster.
+Otherwise upload the patch next to the full image and add "delta_url" and "delta_base" (the version of
+installed.bin) to the version manifest.
+"""
+import hashlib
+import struct
+import sys
+import zlib
+
+SECTOR = 4096
+SEED = 16       # length of the hashed seed used to find matches
+STRIDE = 4      # the installed image is indexed every STRIDE bytes
+MIN_COPY = 32   # shorter matches are cheaper as literal data
+MAX_CANDIDATES = 8
+MAX_PATCH_RATIO = 0.9  # larger patches save too little over the full image to be offered
+
+OP_COPY = 0x00
+OP_DATA = 0x01
+
+
+def allowed_copy_len(out_pos, src, length):
+    """longest prefix of a copy that can be applied in place"""
+    if src < out_pos - out_pos % SECTOR:
+        return 0
+    if src >= out_pos:
+        return length
+    return min(length, SECTOR - out_pos % SECTOR)
+
+
+def match_len(old, src, new, pos):
+    n = 0
+    limit = min(len(old) - src, len(new) - pos)
+    # compare in blocks first, byte by byte only at the end
+    while n + 256 <= limit and old[src + n:src + n + 256] == new[pos + n:pos + n + 256]:
+        n += 256
+    while n < limit and old[src + n] == new[pos + n]:
+        n += 1
+    return n
+
+
+def make_patch(old, new):
+    index = {}
+    for i in range(0, len(old) - SEED + 1, STRIDE):
+        candidates = index.setdefault(old[i:i + SEED], [])
+        if len(candidates) < MAX_CANDIDATES:
+            candidates.append(i)
+
+    ops = bytearray()
+    literal_start = 0
+    pos = 0
+    copied = 0
+
+    def flush_literal(end):
+        if end > literal_start:
+            ops.extend(struct.pack("<BI", OP_DATA, end - literal_start))
+            ops.extend(new[literal_start:end])
+
+    while pos + SEED <= len(new):
+        best = None
+        for cand in index.get(new[pos:pos + SEED], ()):
+            # grow the match backwards into the pending literal bytes
+            start, src = pos, cand
+            while start > literal_start and src > 0 and new[start - 1] == old[src - 1] \
+                    and allowed_copy_len(start - 1, src - 1, 1):
+                start -= 1
+                src -= 1
+            length = allowed_copy_len(start, src, (pos - start) + match_len(old, cand, new, pos))
+            if best is None or length > best[2]:
+                best = (start, src, length)
+        if best is None or best[2] < MIN_COPY:
+            pos += 1
+            continue
+        start, src, length = best
+        flush_literal(start)
+        ops.extend(struct.pack("<BII", OP_COPY, src, length))
+        copied += length
+        pos = start + length
+        literal_start = pos
+    flush_literal(len(new))
+
+    header = b"OTD1" + struct.pack("<I", len(old)) + hashlib.sha256(old).digest() + struct.pack("<I", len(new))
+    return header + bytes(ops), copied
+
+
+def apply_patch(old, patch):
+    """same checks as ota_delta.c, works on a copy of the partition to prove the patch is safe in place"""
+    assert patch[:4] == b"OTD1"
+    base_size, = struct.unpack_from("<I", patch, 4)
+    target_size, = struct.unpack_from("<I", patch, 40)
+    assert hashlib.sha256(old[:base_size]).digest() == patch[8:40]
+    flash = bytearray(old) + bytearray(b"\xff" * max(0, target_size - len(old)))
+    sector = bytearray()
+    produced = 0
+    i = 44
+
+    def emit(data):
+        nonlocal produced
+        for b in data:
+            sector.append(b)
+            produced += 1
+            if len(sector) == SECTOR:
+                flash[produced - SECTOR:produced] = sector
+                sector.clear()
+
+    while produced < target_size:
+        op = patch[i]
+        if op == OP_COPY:
+            src, length = struct.unpack_from("<II", patch, i + 1)
+            i += 9
+            while length:
+                flushed_end = produced - len(sector)
+                assert src >= flushed_end, "COPY reads overwritten data"
+                n = min(length, SECTOR - len(sector))
+                emit(bytes(flash[src:src + n]))
+                src += n
+                length -= n
+        elif op == OP_DATA:
+            length, = struct.unpack_from("<I", patch, i + 1)
+            emit(patch[i + 5:i + 5 + length])
+            i += 5 + length
+        else:
+            raise ValueError("unknown op")
+    assert i == len(patch)
+    flash[produced - len(sector):produced] = sector
+    return bytes(flash[:target_size])
+
+
+def main():
+    if len(sys.argv) != 4:
+        print(__doc__)
+        sys.exit(1)
+    old = open(sys.argv[1], "rb").read()
+    new = open(sys.argv[2], "rb").read()
+    patch, copied = make_patch(old, new)
+    if apply_patch(old, patch) != new:
+        sys.exit("patch does not reproduce the new image")
+    # compared the way both are served, packed with tools/ota_pack.py
+    packed_new = len(zlib.compress(new, 9))
+    packed_patch = len(zlib.compress(patch, 9))
+    if packed_patch > packed_new * MAX_PATCH_RATIO:
+        print("patch %d bytes (%d packed) is not clearly smaller than the image %d bytes (%d packed), %d bytes copied "
+              "from the installed image -> no patch written, leave delta_url out of the manifest"
+              % (len(patch), packed_patch, len(new), packed_new, copied), file=sys.stderr)
+        sys.exit(2)
+    open(sys.argv[3], "wb").write(patch)
+    print("image %d bytes, patch %d bytes (%.1fx smaller, %d vs %d bytes packed), %d bytes copied from the installed image"
+          % (len(new), len(patch), len(new) / len(patch), packed_patch, packed_new, copied))
+
+
+if __name__ == "__main__":
+    main()
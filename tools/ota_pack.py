@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""
+Compresses application images for the compressed download mode of the updater (see main/lib/ota_inflate.h).
+
+    python tools/ota_pack.py [--wbits N] [--link-kbps K] <app.bin> <app.bin.zlib>
+
+The output is a zlib stream. Serve it as the image url with "compression": "zlib" in the version manifest,
+or with "Content-Encoding: deflate" from the server. The device decompresses with a window of
+1 << OTA_INFLATE_WINDOW_BITS bytes, so --wbits must not be larger (both default to 15, 32 KB).
+Patches from tools/ota_delta.py can be packed the same way ("delta_compression": "zlib").
+
+The packer prints the bytes on the wire of both paths, and with --link-kbps (the KB/s of a raw download from the
+"OTA download" log line of the device) the expected download time of both.
+"""
+import argparse
+import sys
+import time
+import zlib
+
+CHUNK = 4096  # the device feeds the decompressor one ring slot / flash sector at a time
+
+
+def pack(image, wbits):
+    compressor = zlib.compressobj(level=9, method=zlib.DEFLATED, wbits=wbits, memLevel=9)
+    return compressor.compress(image) + compressor.flush()
+
+
+def unpack_streaming(packed, wbits):
+    """decompresses in CHUNK sized pieces like the device does"""
+    decompressor = zlib.decompressobj(wbits=wbits)
+    out = bytearray()
+    for i in range(0, len(packed), CHUNK):
+        out += decompressor.decompress(packed[i:i + CHUNK])
+    out += decompressor.flush()
+    if not decompressor.eof or decompressor.unused_data:
+        raise ValueError("stream does not end where the data ends")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--wbits", type=int, default=15, choices=range(9, 16),
+                        help="log2 of the deflate window, at most OTA_INFLATE_WINDOW_BITS of the device")
+    parser.add_argument("--link-kbps", type=float, default=0,
+                        help="raw download throughput in KB/s, to estimate the download time of both paths")
+    parser.add_argument("image")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    image = open(args.image, "rb").read()
+    if not image or image[0] != 0xE9:
+        sys.exit("%s is not an esp32 app image" % args.image)
+
+    start = time.monotonic()
+    packed = pack(image, args.wbits)
+    pack_ms = (time.monotonic() - start) * 1000
+    start = time.monotonic()
+    if unpack_streaming(packed, args.wbits) != image:
+        sys.exit("compressed stream does not reproduce the image")
+    unpack_ms = (time.monotonic() - start) * 1000
+    open(args.output, "wb").write(packed)
+
+    print("image %d bytes, compressed %d bytes on the wire (%.1f%%, %d KB window)"
+          % (len(image), len(packed), 100.0 * len(packed) / len(image), (1 << args.wbits) // 1024))
+    print("host: packed in %.0f ms, unpacked in %.0f ms" % (pack_ms, unpack_ms))
+    if args.link_kbps > 0:
+        raw_s = len(image) / 1024 / args.link_kbps
+        packed_s = len(packed) / 1024 / args.link_kbps
+        print("at %.0f KB/s: raw %.1f s, compressed %.1f s (if the device decompresses faster than the link)"
+              % (args.link_kbps, raw_s, packed_s))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+"""
+Prints the "sha256" and "signature" fields of the version manifest for an application image.
+
+    python tools/ota_sign.py <app.bin> [<signing_key.pem>]
+
+The digest and the signature are over the uncompressed image, also when it is served compressed or as a patch.
+The signature is made with openssl (ECDSA or RSA, SHA-256), the matching public key goes to envdata/otasignkey:
+
+    openssl ecparam -name prime256v1 -genkey -noout -out signing_key.pem
+    openssl ec -in signing_key.pem -pubout -out envdata/otasignkey
+
+Without a key only "sha256" is printed, which the updater checks as long as envdata/otasignkey is the placeholder.
+"""
+import base64
+import hashlib
+import json
+import subprocess
+import sys
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(__doc__)
+        sys.exit(1)
+    image = open(sys.argv[1], "rb").read()
+    fields = {"sha256": hashlib.sha256(image).hexdigest()}
+    if len(sys.argv) == 3:
+        signature = subprocess.run(["openssl", "dgst", "-sha256", "-sign", sys.argv[2], sys.argv[1]],
+                                   check=True, stdout=subprocess.PIPE).stdout
+        fields["signature"] = base64.b64encode(signature).decode()
+    print(json.dumps(fields, indent=4))
+
+
+if __name__ == "__main__":
+    main()